@@ -1,380 +1,4229 @@
 //BT June 12, 2025
 
-//Four-Thread Architecture:
+//Pipeline Architecture:
 
-//Reader thread: Streams lines from input file
-//Worker threads: Process lines (configurable number)
-//Writer thread: Streams output to file
-//Main thread: Coordinates everything
+//Main thread: Reads the header, builds the column selection plan, then starts
+//  and coordinates the other threads
+//Reader thread: Streams data lines from input file in numbered batches
+//Worker threads: Process batches (configurable number)
+//Writer threads: Reorder batches by sequence number and stream output to file
+//  (one writer per cohort when several -s LIST:OUTPUT pairs share one pass)
+//Codec pool: Inflates BGZF input and deflates -z output for the reader and
+//  every writer (--inflate-threads, --deflate-threads)
+//Monitor thread: Progress, --stats and -t auto rebalancing
+//Workers share the selection plan read-only; it never changes once threads start
 
 
 //Memory Optimizations:
 
-//Uses std::move() to avoid unnecessary string copies
-//Reserves vector space to prevent reallocations
-//Processes and immediately releases each line
+//Reads, filters and writes lines in batches of about 4 MB, moved between stages
+//  with std::move() rather than copied
+//Recycles batch buffers through a pool so steady-state runs stop allocating
+//Caps the bytes held in queued batches with --max-memory
 
 
-//Progress Monitoring: Shows progress every 10,000 lines so you can see it's working
+//Progress Monitoring: A monitor thread prints the line count once a second so you
+//can see it's working; --stats reports read, record and output rates instead
 
-//g++ -std=c++11 -O3 -o vcf_filter vcf_filter.cpp -lz -lpthread
+//g++ -std=c++11 -O3 -o VSF VCF_SampleFilter_V1_1.cpp -lz -lpthread
+//  (add -DVSF_HAVE_LIBDEFLATE and -ldeflate for the faster BGZF block codec)
 
 //# Use fewer threads initially to test
-//./vcf_filter -i input.vcf.gz -o output.vcf -s samples.txt -t 2
+//./VSF -i input.vcf.gz -o output.vcf -s samples.txt -t 2
 
 
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <cstring>
 #include <vector>
 #include <unordered_set>
+#include <unordered_map>
 #include <thread>
 #include <mutex>
 #include <queue>
+#include <deque>
+#include <map>
 #include <condition_variable>
 #include <algorithm>
 #include <atomic>
+#include <memory>
+#include <functional>
+#include <cstdint>
+#include <climits>
+#include <chrono>
+#include <random>
 #include <zlib.h>
+#ifdef VSF_HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 
-class VCFSampleFilter {
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#define VSF_HAVE_MMAP 1
+#define VSF_HAVE_WRITEV 1
+#define VSF_HAVE_RUSAGE 1
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define VSF_X86_SIMD 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define VSF_NEON_SIMD 1
+#endif
+
+// Ask for the cache line at p ahead of a read; a no-op without GCC builtins
+static inline void prefetch_read(const void* p) {
+#ifdef __GNUC__
+    __builtin_prefetch(p, 0);
+#else
+    (void)p;
+#endif
+}
+
+// Delimiter scanning kernels. Each appends base + i for every data[i] == delim,
+// working on 64-byte blocks turned into bitmasks, and stops early once out holds
+// at least limit offsets; the best one for the CPU is picked once at startup.
+static void find_delimiters_scalar(const char* data, size_t len, char delim,
+                                   size_t base, std::vector<size_t>& out, size_t limit) {
+    const char* end = data + len;
+    for (const char* p = data; out.size() < limit;) {
+        const char* hit = static_cast<const char*>(memchr(p, delim, end - p));
+        if (!hit) break;
+        out.push_back(base + (hit - data));
+        p = hit + 1;
+    }
+}
+
+// Emit the set bits of a block mask as offsets
+static inline void push_mask_offsets(uint64_t mask, size_t offset, std::vector<size_t>& out) {
+    while (mask) {
+        out.push_back(offset + __builtin_ctzll(mask));
+        mask &= mask - 1;
+    }
+}
+
+#ifdef VSF_X86_SIMD
+__attribute__((target("avx2")))
+static void find_delimiters_avx2(const char* data, size_t len, char delim,
+                                 size_t base, std::vector<size_t>& out, size_t limit) {
+    const __m256i needle = _mm256_set1_epi8(delim);
+    size_t i = 0;
+    for (; i + 64 <= len && out.size() < limit; i += 64) {
+        __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 32));
+        uint64_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, needle))) |
+                        static_cast<uint64_t>(static_cast<uint32_t>(
+                            _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, needle)))) << 32;
+        push_mask_offsets(mask, base + i, out);
+    }
+    find_delimiters_scalar(data + i, len - i, delim, base + i, out, limit);
+}
+
+// SSE2 is part of the x86-64 baseline, so this needs no feature check
+static void find_delimiters_sse2(const char* data, size_t len, char delim,
+                                 size_t base, std::vector<size_t>& out, size_t limit) {
+    const __m128i needle = _mm_set1_epi8(delim);
+    size_t i = 0;
+    for (; i + 64 <= len && out.size() < limit; i += 64) {
+        uint64_t mask = 0;
+        for (int k = 0; k < 4; k++) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 16 * k));
+            mask |= static_cast<uint64_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle))) << (16 * k);
+        }
+        push_mask_offsets(mask, base + i, out);
+    }
+    find_delimiters_scalar(data + i, len - i, delim, base + i, out, limit);
+}
+#endif
+
+#ifdef VSF_NEON_SIMD
+static void find_delimiters_neon(const char* data, size_t len, char delim,
+                                 size_t base, std::vector<size_t>& out, size_t limit) {
+    const uint8x16_t needle = vdupq_n_u8(static_cast<uint8_t>(delim));
+    const uint8_t bit_values[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    const uint8x16_t bits = vld1q_u8(bit_values);
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    size_t i = 0;
+    for (; i + 64 <= len && out.size() < limit; i += 64) {
+        // Weight each matching byte by its bit, then fold pairwise down to 8 bytes
+        uint8x16_t m0 = vandq_u8(vceqq_u8(vld1q_u8(bytes + i), needle), bits);
+        uint8x16_t m1 = vandq_u8(vceqq_u8(vld1q_u8(bytes + i + 16), needle), bits);
+        uint8x16_t m2 = vandq_u8(vceqq_u8(vld1q_u8(bytes + i + 32), needle), bits);
+        uint8x16_t m3 = vandq_u8(vceqq_u8(vld1q_u8(bytes + i + 48), needle), bits);
+        uint8x16_t sum = vpaddq_u8(vpaddq_u8(m0, m1), vpaddq_u8(m2, m3));
+        sum = vpaddq_u8(sum, sum);
+        push_mask_offsets(vgetq_lane_u64(vreinterpretq_u64_u8(sum), 0), base + i, out);
+    }
+    find_delimiters_scalar(data + i, len - i, delim, base + i, out, limit);
+}
+#endif
+
+struct DelimiterKernel {
+    const char* name;
+    void (*find_all)(const char* data, size_t len, char delim, size_t base,
+                     std::vector<size_t>& out, size_t limit);
+};
+
+static DelimiterKernel select_delimiter_kernel() {
+#if defined(VSF_X86_SIMD)
+    if (__builtin_cpu_supports("avx2")) {
+        return {"avx2", find_delimiters_avx2};
+    }
+    return {"sse2", find_delimiters_sse2};
+#elif defined(VSF_NEON_SIMD)
+    return {"neon", find_delimiters_neon};
+#else
+    return {"scalar", find_delimiters_scalar};
+#endif
+}
+
+static const DelimiterKernel delimiter_kernel = select_delimiter_kernel();
+
+// A run of consecutive input lines; seq restores input order in the writer.
+// Stream readers copy whole newline-terminated lines into input; a mapped
+// input instead hands over a range of the mapping, which workers read in place
+struct LineBatch {
+    size_t seq = 0;
+    size_t bytes = 0;
+    std::string input;
+    const char* text = nullptr;  // Mapped range, used when input is empty
+    size_t text_size = 0;
+    std::string output;  // Processed lines, newline-terminated (.bim lines for bed output)
+    std::string genotypes;  // --output-format bed: packed .bed rows, one per output line
+    size_t charged = 0;  // Bytes held against the memory budget
+    uint64_t input_end = 0;  // --checkpoint: input position after the batch's lines
+    size_t lines = 0;        // Input lines the batch held
+};
+
+// --regions: 1-based inclusive position ranges per chromosome, sorted and
+// merged so a position is looked up with one binary search
+class RegionSet {
+public:
+    struct Range {
+        int64_t begin;
+        int64_t end;
+    };
+    typedef std::vector<Range> RangeList;
+
+private:
+    std::unordered_map<std::string, RangeList> ranges;
+    std::vector<std::string> order;  // Chromosomes in the order first given
+
+    void add(const std::string& chrom, int64_t begin, int64_t end) {
+        if (!ranges.count(chrom)) order.push_back(chrom);
+        ranges[chrom].push_back({begin, end});
+    }
+    
+    static bool parse_position(const std::string& text, int64_t& value) {
+        char* end = nullptr;
+        value = strtoll(text.c_str(), &end, 10);
+        return !text.empty() && *end == '\0' && value >= 1;
+    }
+    
+    // "chr", "chr:pos", "chr:begin-end" or "chr:begin-"
+    void add_spec(const std::string& spec) {
+        size_t colon = spec.rfind(':');
+        if (colon == std::string::npos) {
+            add(spec, 1, INT64_MAX);
+            return;
+        }
+        
+        std::string chrom = spec.substr(0, colon);
+        std::string span = spec.substr(colon + 1);
+        size_t dash = span.find('-');
+        int64_t begin, end = INT64_MAX;
+        bool ok = parse_position(span.substr(0, dash), begin);
+        if (dash == std::string::npos) {
+            end = begin;
+        } else if (dash + 1 < span.size()) {
+            ok = ok && parse_position(span.substr(dash + 1), end);
+        }
+        if (!ok || chrom.empty() || end < begin) {
+            throw std::runtime_error("Invalid region: " + spec);
+        }
+        add(chrom, begin, end);
+    }
+
+public:
+    bool empty() const { return ranges.empty(); }
+    const std::vector<std::string>& chromosomes() const { return order; }
+    
+    // Parse a comma-separated list of regions, or a file of one region per
+    // line given either as chr:begin-end or as tab-separated CHROM BEGIN [END]
+    void load(const std::string& arg) {
+        std::ifstream file(arg);
+        if (file) {
+            std::string line;
+            while (std::getline(file, line)) {
+                if (line.empty() || line[0] == '#') continue;
+                std::istringstream fields(line);
+                std::string chrom, begin, end;
+                std::getline(fields, chrom, '\t');
+                if (!std::getline(fields, begin, '\t')) {
+                    add_spec(chrom);
+                } else if (!std::getline(fields, end, '\t')) {
+                    add_spec(chrom + ":" + begin);
+                } else {
+                    add_spec(chrom + ":" + begin + "-" + end);
+                }
+            }
+        } else {
+            std::istringstream list(arg);
+            std::string spec;
+            while (std::getline(list, spec, ',')) {
+                if (!spec.empty()) add_spec(spec);
+            }
+        }
+        if (ranges.empty()) {
+            throw std::runtime_error("No regions given in " + arg);
+        }
+        
+        for (auto& entry : ranges) {
+            RangeList& list = entry.second;
+            std::sort(list.begin(), list.end(), [](const Range& a, const Range& b) { return a.begin < b.begin; });
+            RangeList merged;
+            for (const Range& range : list) {
+                if (!merged.empty() && range.begin <= merged.back().end) {
+                    merged.back().end = std::max(merged.back().end, range.end);
+                } else {
+                    merged.push_back(range);
+                }
+            }
+            list.swap(merged);
+        }
+    }
+    
+    // Ranges on one chromosome, nullptr if none
+    const RangeList* find(const std::string& chrom) const {
+        auto it = ranges.find(chrom);
+        return it == ranges.end() ? nullptr : &it->second;
+    }
+    
+    static bool contains(const RangeList& list, int64_t pos) {
+        auto it = std::upper_bound(list.begin(), list.end(), pos,
+                                   [](int64_t p, const Range& range) { return p < range.begin; });
+        return it != list.begin() && pos <= (it - 1)->end;
+    }
+};
+
+// Which subfields of one FORMAT string survive --format-fields
+struct FormatProjection {
+    std::vector<int> keep;  // Subfield indices to copy, ascending
+    std::string format;     // Rewritten FORMAT column
+    int gt_index = -1;      // Position of GT, -1 if absent
+};
+
+// Per-thread buffers reused by the record kernel across lines
+struct RecordScratch {
+    std::vector<size_t> tabs;
+    std::vector<size_t> newlines;
+    
+    // --format-fields projections keyed by FORMAT string; consecutive records
+    // nearly always share one, so the last hit is checked before the map
+    std::unordered_map<std::string, FormatProjection> projections;
+    const std::pair<const std::string, FormatProjection>* last_projection = nullptr;
+    std::string format_key;
+    std::vector<int> allele_counts;  // Alleles called in the selected samples, index 0 = REF
+    int allele_number = 0;           // Sum of allele_counts (AN)
+    std::vector<size_t> sites_dropped;  // Records removed by site filters, per cohort
+    std::vector<size_t> bed_skipped;    // Records bed output cannot hold, per cohort
+    bool skipped_for_bed = false;       // Why the last process_data_line() wrote nothing
+    
+    // --regions lookup for the chromosome of the previous record
+    std::string region_chrom;
+    const RegionSet::RangeList* region_ranges = nullptr;
+};
+
+// Consecutive selected columns copied as one byte range
+struct ColumnRun {
+    int first;
+    int count;
+};
+
+// Column selection computed once from the header, shared read-only by workers
+struct SelectionPlan {
+    std::vector<int> sample_indices;
+    std::vector<ColumnRun> runs;  // sample_indices merged into contiguous runs
+    int last_column = 0;          // Scanning stops once this column is found
+    std::string header;         // Meta lines plus rewritten #CHROM line, newline-terminated
+    size_t output_columns = 0;  // Fixed columns plus selected samples
+    std::vector<std::string> format_fields;  // FORMAT keys to keep; empty keeps all
+    bool fill_tags = false;     // Recompute INFO AC/AN/AF from the selected genotypes
+    int min_ac = 0;             // Minimum ALT allele count among selected samples
+    bool exclude_monomorphic = false;  // Drop sites with fewer than two alleles called
+    bool plink_bed = false;     // Write PLINK .bed genotypes and .bim sites instead of VCF text
+    std::vector<std::string> sample_names;  // Selected samples in output order
+    
+    // Site filters and --fill-tags need the selected genotypes counted
+    bool counts_alleles() const { return fill_tags || min_ac > 0 || exclude_monomorphic; }
+};
+
+// Caps how many threads of a stage run at once. With -t auto every stage
+// gets threads for the whole budget and permits move between the stages'
+// gates, so a stage grows or shrinks without starting or stopping threads
+class ThreadGate {
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    int limit = INT_MAX;
+    int active = 0;
+
+public:
+    void enter() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return active < limit; });
+        active++;
+    }
+    
+    void leave() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            active--;
+        }
+        cv.notify_one();
+    }
+    
+    void set_limit(int permits) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            limit = permits;
+        }
+        cv.notify_all();
+    }
+};
+
+// Fixed set of threads draining one shared FIFO queue of tasks; the codec
+// stages submit to a single pool, so any idle thread takes the next block of
+// any stage. Tasks report their own completion; pending tasks still run
+// before the pool shuts down. A pool of zero threads runs each task inline in
+// submit(). With a gate, a thread holds one of its permits while it runs a task
+class TaskPool {
+private:
+    std::vector<std::thread> threads;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+    ThreadGate* gate;
+    
+    void run() {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return !tasks.empty() || stopping; });
+            if (tasks.empty()) break;
+            
+            std::function<void()> task = std::move(tasks.front());
+            tasks.pop();
+            lock.unlock();
+            if (gate) gate->enter();
+            task();
+            if (gate) gate->leave();
+        }
+    }
+
+public:
+    explicit TaskPool(int count, ThreadGate* gate = nullptr) : gate(gate) {
+        for (int i = 0; i < count; i++) {
+            threads.emplace_back(&TaskPool::run, this);
+        }
+    }
+    
+    ~TaskPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    
+    void submit(std::function<void()> task) {
+        if (threads.empty()) {
+            task();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push(std::move(task));
+        }
+        cv.notify_one();
+    }
+    
+    int size() const { return static_cast<int>(threads.size()); }
+};
+
+// Spin-then-sleep wait point. Waiters re-check their condition after every
+// wakeup; notify_all() bumps the epoch and only enters the kernel when a
+// thread is actually asleep (a futex on Linux, a condition variable elsewhere)
+class WaitPoint {
+private:
+    static const int SPIN_LIMIT = 128;
+    std::atomic<uint32_t> epoch{0};
+    std::atomic<uint32_t> sleepers{0};
+#ifndef __linux__
+    std::mutex mutex;
+    std::condition_variable cv;
+#endif
+    
+    static void cpu_relax() {
+#ifdef VSF_X86_SIMD
+        _mm_pause();
+#else
+        std::this_thread::yield();
+#endif
+    }
+    
+    void sleep(uint32_t seen) {
+        sleepers.fetch_add(1);
+        if (epoch.load() == seen) {
+#ifdef __linux__
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch), FUTEX_WAIT_PRIVATE, seen,
+                    nullptr, nullptr, 0);
+#else
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this, seen] { return epoch.load() != seen; });
+#endif
+        }
+        sleepers.fetch_sub(1);
+    }
+
+public:
+    // Block until ready() holds
+    template <typename Ready>
+    void wait_until(Ready ready) {
+        for (int i = 0; i < SPIN_LIMIT; i++) {
+            if (ready()) return;
+            cpu_relax();
+        }
+        while (true) {
+            uint32_t seen = epoch.load();
+            if (ready()) return;
+            sleep(seen);
+        }
+    }
+    
+    void notify_all() {
+        epoch.fetch_add(1);
+        if (sleepers.load() == 0) return;
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch), FUTEX_WAKE_PRIVATE, INT_MAX,
+                nullptr, nullptr, 0);
+#else
+        { std::lock_guard<std::mutex> lock(mutex); }
+        cv.notify_all();
+#endif
+    }
+};
+
+// Bounded lock-free multi-producer/multi-consumer queue (Vyukov's ring of
+// sequence-stamped slots). Capacity is rounded up to a power of two
+template <typename T>
+class BoundedQueue {
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        T value;
+    };
+    
+    std::unique_ptr<Slot[]> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head{0};  // Next slot to fill
+    alignas(64) std::atomic<size_t> tail{0};  // Next slot to drain
+    std::atomic<bool> closed{false};
+    WaitPoint not_full;
+    WaitPoint not_empty;
+    
+    bool try_push(T& value) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots[pos & mask];
+            size_t seq = slot.seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.value = std::move(value);
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;  // Full
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    bool try_pop(T& value) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots[pos & mask];
+            size_t seq = slot.seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    value = std::move(slot.value);
+                    slot.seq.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;  // Empty
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+public:
+    explicit BoundedQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        slots.reset(new Slot[size]);
+        for (size_t i = 0; i < size; i++) {
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+        mask = size - 1;
+    }
+    
+    // Blocks while the queue is full
+    void push(T&& value) {
+        not_full.wait_until([this, &value] { return try_push(value); });
+        not_empty.notify_all();
+    }
+    
+    // Blocks while the queue is empty; false once closed and drained
+    bool pop(T& value) {
+        bool got = false;
+        not_empty.wait_until([this, &value, &got] {
+            got = try_pop(value);
+            return got || closed.load();
+        });
+        if (!got) got = try_pop(value);  // Items pushed just before close
+        if (got) not_full.notify_all();
+        return got;
+    }
+    
+    // Non-blocking push; false (value untouched) when the queue is full
+    bool try_put(T& value) {
+        if (!try_push(value)) return false;
+        not_empty.notify_all();
+        return true;
+    }
+    
+    // Non-blocking pop; false when the queue is empty
+    bool try_take(T& value) {
+        if (!try_pop(value)) return false;
+        not_full.notify_all();
+        return true;
+    }
+    
+    // Approximate number of queued items, for reporting
+    size_t size() const {
+        size_t filled = head.load(std::memory_order_relaxed);
+        size_t drained = tail.load(std::memory_order_relaxed);
+        return filled > drained ? filled - drained : 0;
+    }
+    
+    // No more pushes; wakes consumers so they can drain and stop
+    void close() {
+        closed.store(true);
+        not_empty.notify_all();
+    }
+};
+
+// Lock-free reorder stage between many producers and one consumer. Item seq
+// lands in slot seq % capacity once the consumer is within capacity of it, and
+// the consumer takes items strictly in sequence order
+template <typename T>
+class ReorderRing {
+private:
+    struct Slot {
+        std::atomic<size_t> ready{0};  // seq + 1 once the slot holds item seq
+        T value;
+    };
+    
+    std::unique_ptr<Slot[]> slots;
+    size_t capacity;
+    // Padding instead of alignas: rings live in heap-allocated cohorts, and
+    // C++11 operator new ignores extended alignment
+    char pad[64];
+    std::atomic<size_t> next{0};  // Next seq the consumer takes
+    char pad_after[64];
+    std::atomic<bool> closed{false};
+    WaitPoint window_open;
+    WaitPoint item_ready;
+
+public:
+    explicit ReorderRing(size_t capacity) : slots(new Slot[capacity]), capacity(capacity) {}
+    
+    // Blocks while seq is more than capacity ahead of the consumer
+    void push(size_t seq, T&& value) {
+        window_open.wait_until([this, seq] { return seq < next.load(std::memory_order_acquire) + capacity; });
+        Slot& slot = slots[seq % capacity];
+        slot.value = std::move(value);
+        slot.ready.store(seq + 1, std::memory_order_release);
+        item_ready.notify_all();
+    }
+    
+    // Blocks until the next item in order arrives; false once closed and drained
+    bool pop(T& value) {
+        size_t seq = next.load(std::memory_order_relaxed);
+        Slot& slot = slots[seq % capacity];
+        auto has_item = [&slot, seq] { return slot.ready.load(std::memory_order_acquire) == seq + 1; };
+        item_ready.wait_until([this, &has_item] { return has_item() || closed.load(); });
+        if (!has_item()) return false;
+        
+        value = std::move(slot.value);
+        next.store(seq + 1, std::memory_order_release);
+        window_open.notify_all();
+        return true;
+    }
+    
+    // Non-blocking pop; false unless the next item in order is already here
+    bool try_pop(T& value) {
+        size_t seq = next.load(std::memory_order_relaxed);
+        Slot& slot = slots[seq % capacity];
+        if (slot.ready.load(std::memory_order_acquire) != seq + 1) return false;
+        
+        value = std::move(slot.value);
+        next.store(seq + 1, std::memory_order_release);
+        window_open.notify_all();
+        return true;
+    }
+    
+    // No more pushes (all producers have finished)
+    void close() {
+        closed.store(true);
+        item_ready.notify_all();
+    }
+};
+
+// Recycles large byte buffers between pipeline stages so steady-state
+// processing allocates nothing: cleared buffers keep their capacity and
+// their pages stay faulted in. Buffers grown well past a batch (by a very
+// long line) are freed rather than kept
+class BufferPool {
+private:
+    BoundedQueue<std::string> buffers;
+    size_t max_capacity;
+
+public:
+    BufferPool(size_t count, size_t max_capacity) : buffers(count), max_capacity(max_capacity) {}
+    
+    void set_max_capacity(size_t bytes) { max_capacity = bytes; }
+    
+    // An empty buffer, recycled when one is available
+    std::string take() {
+        std::string buffer;
+        buffers.try_take(buffer);
+        return buffer;
+    }
+    
+    void give(std::string&& buffer) {
+        if (buffer.capacity() == 0 || buffer.capacity() > max_capacity) return;
+        buffer.clear();
+        buffers.try_put(buffer);
+    }
+};
+
+// Byte budget shared by everything queued between the reader and the writer.
+// Only the reader blocks on it; a batch is admitted whenever nothing else is
+// in flight, so a single oversized batch cannot stall the pipeline
+class ByteBudget {
+private:
+    std::atomic<size_t> limit;  // 0 = unlimited
+    std::atomic<size_t> used{0};
+    WaitPoint released;
+
+public:
+    explicit ByteBudget(size_t limit = 0) : limit(limit) {}
+    
+    // Also used with 0 to lift the cap when a failed stage stops releasing
+    void set_limit(size_t bytes) {
+        limit.store(bytes);
+        released.notify_all();
+    }
+    
+    // Blocks until bytes fit in the budget, then charges them
+    void acquire(size_t bytes) {
+        if (limit.load()) {
+            released.wait_until([this, bytes] {
+                size_t current = used.load();
+                size_t cap = limit.load();
+                return cap == 0 || current == 0 || current + bytes <= cap;
+            });
+        }
+        used.fetch_add(bytes);
+    }
+    
+    void release(size_t bytes) {
+        used.fetch_sub(bytes);
+        if (limit.load()) released.notify_all();
+    }
+    
+    size_t in_use() const { return used.load(); }
+    
+    // Re-charge a batch whose footprint changed, without blocking
+    void resize(size_t from, size_t to) {
+        if (to > from) {
+            used.fetch_add(to - from);
+        } else {
+            release(from - to);
+        }
+    }
+};
+
+// BGZF framing: a gzip member with a 'BC' extra subfield holding the block size
+static const size_t BGZF_MAX_BLOCK_SIZE = 65536;
+static const size_t BGZF_BLOCK_DATA = 0xff00;  // Uncompressed bytes per written block
+static const size_t BGZF_HEADER_SIZE = 18;
+static const size_t BGZF_FOOTER_SIZE = 8;
+static const unsigned char BGZF_EOF_BLOCK[28] = {
+    0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+static inline uint16_t le16(const unsigned char* p) { return p[0] | (p[1] << 8); }
+static inline uint32_t le32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+static inline void put_le16(unsigned char* p, uint16_t v) {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+static inline void put_le32(unsigned char* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (v >> (8 * i)) & 0xff;
+}
+
+// Binning scheme shared by tabix and CSI indexes (SAM specification 5.3)
+static uint32_t pseudo_bin(int depth) { return ((1u << (3 * depth + 3)) - 1) / 7 + 1; }
+
+// Smallest bin fully containing the 0-based half-open interval [begin, end)
+static uint32_t reg2bin(int64_t begin, int64_t end, int min_shift, int depth) {
+    int shift = min_shift;
+    uint32_t offset = ((1u << (3 * depth)) - 1) / 7;
+    end--;
+    for (int level = depth; level > 0; level--) {
+        if (begin >> shift == end >> shift) return offset + static_cast<uint32_t>(begin >> shift);
+        shift += 3;
+        offset -= 1u << (3 * (level - 1));
+    }
+    return 0;
+}
+
+// First coordinate covered by a bin
+static int64_t bin_start(uint32_t bin, int min_shift, int depth) {
+    uint32_t offset = 0;
+    for (int level = 0; level <= depth; level++) {
+        uint32_t count = 1u << (3 * level);
+        if (bin < offset + count) {
+            return static_cast<int64_t>(bin - offset) << (min_shift + 3 * (depth - level));
+        }
+        offset += count;
+    }
+    return 0;
+}
+
+// Every bin overlapping [begin, end), coarsest level first
+static void reg2bins(int64_t begin, int64_t end, int min_shift, int depth, std::vector<uint32_t>& bins) {
+    end--;
+    uint32_t offset = 0;
+    for (int level = 0; level <= depth; level++) {
+        int shift = min_shift + 3 * (depth - level);
+        for (int64_t i = begin >> shift; i <= end >> shift; i++) {
+            bins.push_back(offset + static_cast<uint32_t>(i));
+        }
+        offset += 1u << (3 * level);
+    }
+}
+
+// CHROM and the 0-based half-open span of a VCF record: POS plus the REF
+// length, or INFO/END when present
+static bool record_span(const char* line, size_t len, std::string& chrom, int64_t& begin, int64_t& end) {
+    const char* end_of_line = line + len;
+    const char* col_end[8];
+    const char* p = line;
+    for (int col = 0; col < 8; col++) {
+        const char* tab = static_cast<const char*>(memchr(p, '\t', end_of_line - p));
+        if (!tab && col < 7) return false;
+        col_end[col] = tab ? tab : end_of_line;
+        p = col_end[col] + 1;
+    }
+    
+    chrom.assign(line, col_end[0]);
+    begin = std::strtoll(col_end[0] + 1, nullptr, 10) - 1;
+    if (begin < 0) begin = 0;
+    end = begin + (col_end[3] - col_end[2] - 1);
+    
+    for (const char* key = col_end[6] + 1; key < col_end[7];) {
+        if (col_end[7] - key > 4 && memcmp(key, "END=", 4) == 0) {
+            end = std::strtoll(key + 4, nullptr, 10);
+            break;
+        }
+        const char* next = static_cast<const char*>(memchr(key, ';', col_end[7] - key));
+        if (!next) break;
+        key = next + 1;
+    }
+    return true;
+}
+
+// BCF 2.2 framing: the header text, then records of l_shared and l_indiv
+// followed by the site part and the per-sample FORMAT arrays (VCF
+// specification 6.3). Values carry a type byte: the low nibble is the type,
+// the high nibble the count, 15 meaning a typed integer count follows
+static const char BCF_MAGIC[5] = {'B', 'C', 'F', 2, 2};
+static const size_t BCF_SHARED_N_SAMPLE = 20;  // Offset of n_fmt << 24 | n_sample in the site part
+static const uint32_t BCF_MAX_PART = 1u << 30;  // Sanity cap on l_shared and l_indiv
+
+static size_t bcf_type_size(unsigned type) {
+    switch (type) {
+        case 1: return 1;  // int8
+        case 2: return 2;  // int16
+        case 3: return 4;  // int32
+        case 5: return 4;  // float
+        case 7: return 1;  // char
+        default: throw std::runtime_error("Malformed BCF record: unknown value type");
+    }
+}
+
+// Read a typed integer scalar at p, advancing p
+static int64_t bcf_typed_int(const unsigned char*& p, const unsigned char* end) {
+    if (p >= end) throw std::runtime_error("Truncated BCF record");
+    unsigned type = *p++ & 0x0f;
+    size_t size = bcf_type_size(type);
+    if (type == 5 || type == 7 || static_cast<size_t>(end - p) < size) {
+        throw std::runtime_error("Malformed BCF record: bad typed integer");
+    }
+    int64_t value = type == 1 ? static_cast<int8_t>(p[0])
+                  : type == 2 ? static_cast<int16_t>(le16(p))
+                              : static_cast<int32_t>(le32(p));
+    p += size;
+    return value;
+}
+
+// "-" as a file name means stdin or stdout
+static bool is_stdio(const std::string& filename) { return filename == "-"; }
+
+// Where output named "-" goes. When an output is stdout, main points
+// std::cout, which carries the progress messages, at stderr; this keeps the
+// real stdout
+static std::streambuf* stdout_data = std::cout.rdbuf();
+
+#ifdef VSF_HAVE_MMAP
+// Grow a pipe's kernel buffer so the other end of the pipeline runs in
+// larger steps; a no-op for files and where the call is unavailable
+static void widen_pipe(int fd) {
+#ifdef F_SETPIPE_SZ
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        fcntl(fd, F_SETPIPE_SZ, 1 << 20);
+    }
+#else
+    (void)fd;
+#endif
+}
+#endif
+
+// Raw-deflate codecs for single BGZF blocks. Built with -DVSF_HAVE_LIBDEFLATE
+// (and -ldeflate) they use libdeflate, which works on whole buffers and is
+// much faster than zlib at this block size; otherwise zlib. One object per
+// task, never shared between threads
+#ifdef VSF_HAVE_LIBDEFLATE
+static const char* const BLOCK_CODEC = "libdeflate";
+#else
+static const char* const BLOCK_CODEC = "zlib";
+#endif
+
+static inline uint32_t block_crc32(const char* data, size_t len) {
+#ifdef VSF_HAVE_LIBDEFLATE
+    return libdeflate_crc32(0, data, len);
+#else
+    return crc32(0L, reinterpret_cast<const unsigned char*>(data), static_cast<uInt>(len));
+#endif
+}
+
+class BlockDeflater {
+private:
+#ifdef VSF_HAVE_LIBDEFLATE
+    libdeflate_compressor* compressor;
+#else
+    z_stream zs;
+#endif
+
+public:
+    explicit BlockDeflater(int level) {
+#ifdef VSF_HAVE_LIBDEFLATE
+        compressor = libdeflate_alloc_compressor(level == Z_DEFAULT_COMPRESSION ? 6 : level);
+        if (!compressor) {
+            throw std::runtime_error("Cannot initialise deflate");
+        }
+#else
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::runtime_error("Cannot initialise deflate");
+        }
+#endif
+    }
+    
+    ~BlockDeflater() {
+#ifdef VSF_HAVE_LIBDEFLATE
+        libdeflate_free_compressor(compressor);
+#else
+        deflateEnd(&zs);
+#endif
+    }
+    
+    BlockDeflater(const BlockDeflater&) = delete;
+    BlockDeflater& operator=(const BlockDeflater&) = delete;
+    
+    // Compressed size, or 0 if the result does not fit in max bytes
+    size_t compress(const char* data, size_t len, unsigned char* out, size_t max) {
+#ifdef VSF_HAVE_LIBDEFLATE
+        return libdeflate_deflate_compress(compressor, data, len, out, max);
+#else
+        deflateReset(&zs);
+        zs.next_in = reinterpret_cast<unsigned char*>(const_cast<char*>(data));
+        zs.avail_in = static_cast<uInt>(len);
+        zs.next_out = out;
+        zs.avail_out = static_cast<uInt>(max);
+        if (deflate(&zs, Z_FINISH) != Z_STREAM_END) return 0;
+        return max - zs.avail_out;
+#endif
+    }
+};
+
+class BlockInflater {
+private:
+#ifdef VSF_HAVE_LIBDEFLATE
+    libdeflate_decompressor* decompressor;
+#else
+    z_stream zs;
+#endif
+
+public:
+    BlockInflater() {
+#ifdef VSF_HAVE_LIBDEFLATE
+        decompressor = libdeflate_alloc_decompressor();
+        if (!decompressor) {
+            throw std::runtime_error("Cannot initialise inflate");
+        }
+#else
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, -15) != Z_OK) {
+            throw std::runtime_error("Cannot initialise inflate");
+        }
+#endif
+    }
+    
+    ~BlockInflater() {
+#ifdef VSF_HAVE_LIBDEFLATE
+        libdeflate_free_decompressor(decompressor);
+#else
+        inflateEnd(&zs);
+#endif
+    }
+    
+    BlockInflater(const BlockInflater&) = delete;
+    BlockInflater& operator=(const BlockInflater&) = delete;
+    
+    // False unless the data inflates to exactly out_len bytes
+    bool decompress(const unsigned char* data, size_t len, char* out, size_t out_len) {
+#ifdef VSF_HAVE_LIBDEFLATE
+        return libdeflate_deflate_decompress(decompressor, data, len, out, out_len, nullptr) ==
+               LIBDEFLATE_SUCCESS;
+#else
+        inflateReset(&zs);
+        zs.next_in = const_cast<unsigned char*>(data);
+        zs.avail_in = static_cast<uInt>(len);
+        zs.next_out = reinterpret_cast<unsigned char*>(out);
+        zs.avail_out = static_cast<uInt>(out_len);
+        return inflate(&zs, Z_FINISH) == Z_STREAM_END && zs.avail_out == 0;
+#endif
+    }
+};
+
+// Writes BGZF output: the stream is cut into fixed BGZF_BLOCK_DATA-byte blocks,
+// groups of blocks are deflated on a pool of threads, and finished groups are
+// appended to the file in order. The compressed start of every block is kept
+// so uncompressed positions can be turned into virtual offsets for indexing
+class BgzfWriter {
+private:
+    struct Job {
+        std::vector<char> data;
+        std::vector<unsigned char> compressed;
+        std::vector<uint32_t> block_sizes;  // Compressed size of each block
+        size_t data_size = 0;               // Uncompressed bytes; data is released once compressed
+        bool done = false;
+        std::string error;
+    };
+    
+    static const size_t JOB_BYTES = 64 * BGZF_BLOCK_DATA;
+    std::ofstream file_out;
+    std::ostream file;  // file_out, or stdout for "-"
+    int level;
+    std::shared_ptr<Job> current;
+    std::deque<std::shared_ptr<Job>> in_flight;  // Output order
+    size_t window;
+    uint64_t uncompressed_size = 0;
+    uint64_t compressed_size = 0;
+    std::vector<uint64_t> block_offsets;  // Compressed start of each block written
+    std::vector<uint64_t> block_starts;   // Uncompressed start of each; flush() ends blocks early
+    uint64_t blocks_data = 0;             // Uncompressed bytes in the blocks written
+    std::mutex mutex;
+    std::condition_variable done_cv;
+    size_t running = 0;  // Submitted jobs whose task has not finished
+    TaskPool own_pool;   // Declared last so it drains before the members its tasks use
+    TaskPool* pool;      // own_pool, or a pool shared with other stages
+    
+    // Append one complete BGZF block; data that deflate cannot fit is stored
+    static uint32_t deflate_block(BlockDeflater& deflater, const char* data, size_t len,
+                                  std::vector<unsigned char>& out) {
+        size_t start = out.size();
+        out.resize(start + BGZF_MAX_BLOCK_SIZE);
+        unsigned char* block = out.data() + start;
+        const size_t max_cdata = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+        
+        size_t cdata = deflater.compress(data, len, block + BGZF_HEADER_SIZE, max_cdata);
+        if (cdata == 0) {
+            // One final stored block: BFINAL/BTYPE byte, LEN, NLEN, then the data.
+            // Built by hand because not every libdeflate accepts level 0
+            unsigned char* stored = block + BGZF_HEADER_SIZE;
+            stored[0] = 1;
+            put_le16(stored + 1, static_cast<uint16_t>(len));
+            put_le16(stored + 3, static_cast<uint16_t>(~len));
+            memcpy(stored + 5, data, len);
+            cdata = len + 5;
+        }
+        
+        static const unsigned char header[BGZF_HEADER_SIZE] = {
+            0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0, 0};
+        size_t block_size = BGZF_HEADER_SIZE + cdata + BGZF_FOOTER_SIZE;
+        memcpy(block, header, sizeof(header));
+        put_le16(block + 16, static_cast<uint16_t>(block_size - 1));
+        put_le32(block + BGZF_HEADER_SIZE + cdata, block_crc32(data, len));
+        put_le32(block + BGZF_HEADER_SIZE + cdata + 4, static_cast<uint32_t>(len));
+        out.resize(start + block_size);
+        return static_cast<uint32_t>(block_size);
+    }
+    
+    void compress_job(Job& job) {
+        BlockDeflater deflater(level);
+        job.data_size = job.data.size();
+        job.compressed.reserve(job.data.size() / 2);
+        for (size_t pos = 0; pos < job.data.size(); pos += BGZF_BLOCK_DATA) {
+            size_t len = std::min(BGZF_BLOCK_DATA, job.data.size() - pos);
+            job.block_sizes.push_back(deflate_block(deflater, job.data.data() + pos, len, job.compressed));
+        }
+    }
+    
+    void submit(std::shared_ptr<Job> job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            in_flight.push_back(job);
+            running++;
+        }
+        pool->submit([this, job] {
+            std::string error;
+            try {
+                compress_job(*job);
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+            std::vector<char>().swap(job->data);
+            
+            std::lock_guard<std::mutex> lock(mutex);
+            job->error = error;
+            job->done = true;
+            running--;
+            done_cv.notify_all();
+        });
+        
+        while (in_flight.size() >= window) {
+            write_front();
+        }
+    }
+    
+    // Wait for the oldest job and append its blocks to the file
+    void write_front() {
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [this] { return in_flight.front()->done; });
+        std::shared_ptr<Job> job = in_flight.front();
+        in_flight.pop_front();
+        lock.unlock();
+        
+        if (!job->error.empty()) {
+            throw std::runtime_error(job->error);
+        }
+        for (size_t b = 0; b < job->block_sizes.size(); b++) {
+            block_offsets.push_back(compressed_size);
+            block_starts.push_back(blocks_data);
+            compressed_size += job->block_sizes[b];
+            blocks_data += std::min(BGZF_BLOCK_DATA, job->data_size - b * BGZF_BLOCK_DATA);
+        }
+        file.write(reinterpret_cast<const char*>(job->compressed.data()), job->compressed.size());
+        if (!file) {
+            throw std::runtime_error("Write error on output file");
+        }
+    }
+
+public:
+    // With a shared pool, threads only sizes the window of jobs in flight.
+    // With append, blocks go after whatever the file already holds
+    BgzfWriter(const std::string& filename, int threads, int level = Z_DEFAULT_COMPRESSION,
+               TaskPool* shared_pool = nullptr, bool append = false)
+        : file(nullptr), level(level), current(new Job),
+          window(std::max(1, 2 * threads)), own_pool(shared_pool ? 0 : threads),
+          pool(shared_pool ? shared_pool : &own_pool) {
+        if (is_stdio(filename)) {
+            file.rdbuf(stdout_data);
+        } else {
+            file_out.open(filename, append ? std::ios::binary | std::ios::app : std::ios::binary);
+            if (!file_out) {
+                throw std::runtime_error("Cannot create output file: " + filename);
+            }
+            file.rdbuf(file_out.rdbuf());
+            if (append) {
+                compressed_size = static_cast<uint64_t>(std::ifstream(filename, std::ios::binary | std::ios::ate).tellg());
+            }
+        }
+    }
+    
+    // A shared pool outlives the writer; wait out tasks still using it
+    ~BgzfWriter() {
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [this] { return running == 0; });
+    }
+    
+    void write(const char* data, size_t len) {
+        uncompressed_size += len;
+        while (len > 0) {
+            size_t n = std::min(len, JOB_BYTES - current->data.size());
+            current->data.insert(current->data.end(), data, data + n);
+            data += n;
+            len -= n;
+            if (current->data.size() == JOB_BYTES) {
+                submit(current);
+                current.reset(new Job);
+            }
+        }
+    }
+    
+    // Uncompressed bytes written so far
+    uint64_t tell() const { return uncompressed_size; }
+    
+    // Write out everything so far, ending the last block early; returns the
+    // file's length, which is then a block boundary
+    uint64_t flush() {
+        if (!current->data.empty()) {
+            submit(current);
+            current.reset(new Job);
+        }
+        while (!in_flight.empty()) {
+            write_front();
+        }
+        file.flush();
+        if (!file) {
+            throw std::runtime_error("Write error on output file");
+        }
+        return compressed_size;
+    }
+    
+    // Flush everything and append the empty end-of-file block; parts meant to
+    // be concatenated leave it off
+    void close(bool write_eof = true) {
+        if (!current->data.empty()) {
+            submit(current);
+            current.reset(new Job);
+        }
+        while (!in_flight.empty()) {
+            write_front();
+        }
+        
+        if (write_eof) {
+            file.write(reinterpret_cast<const char*>(BGZF_EOF_BLOCK), sizeof(BGZF_EOF_BLOCK));
+        }
+        file.flush();
+        if (file_out.is_open()) file_out.close();
+        if (!file || !file_out.good()) {
+            throw std::runtime_error("Write error on output file");
+        }
+    }
+    
+    // Map an uncompressed position to a BGZF virtual offset (valid after close).
+    // Blocks are looked up by their start, since flush() can end one early; the
+    // end of a full last block maps to the end of the file
+    uint64_t virtual_offset(uint64_t pos) const {
+        if (block_starts.empty() || pos > blocks_data) {
+            return compressed_size << 16;
+        }
+        size_t block = std::upper_bound(block_starts.begin(), block_starts.end(), pos) - block_starts.begin() - 1;
+        uint64_t within = pos - block_starts[block];
+        if (within == BGZF_BLOCK_DATA) {
+            return compressed_size << 16;  // Only the last block can end at pos
+        }
+        return (block_offsets[block] << 16) | within;
+    }
+};
+
+// Builds a tabix (.tbi) or CSI index for VCF records written through a
+// BgzfWriter. Records are added with uncompressed offsets, which are turned
+// into virtual offsets when the index is written
+class IndexBuilder {
+private:
+    static const int MIN_SHIFT = 14;
+    
+    struct Chunk {
+        uint64_t begin;
+        uint64_t end;
+    };
+    
+    struct Reference {
+        std::string name;
+        std::map<uint32_t, std::vector<Chunk>> bins;
+        std::vector<uint64_t> linear;  // Lowest record start per 16 kb window
+        uint64_t first_offset = 0;
+        uint64_t last_offset = 0;
+        uint64_t records = 0;
+        int64_t last_pos = -1;
+    };
+    
+    bool csi;
+    int depth;
+    std::vector<Reference> refs;
+    std::unordered_set<std::string> finished_refs;
+    
+    static void put32(std::string& out, uint32_t v) {
+        unsigned char b[4];
+        put_le32(b, v);
+        out.append(reinterpret_cast<char*>(b), 4);
+    }
+    
+    static void put64(std::string& out, uint64_t v) {
+        put32(out, static_cast<uint32_t>(v));
+        put32(out, static_cast<uint32_t>(v >> 32));
+    }
+
+public:
+    explicit IndexBuilder(bool csi) : csi(csi), depth(csi ? 6 : 5) {}
+    
+    // Record one data line spanning [begin, end) on chrom, stored at [start, stop)
+    void add(const std::string& chrom, int64_t begin, int64_t end, uint64_t start, uint64_t stop) {
+        if (refs.empty() || refs.back().name != chrom) {
+            if (!refs.empty()) finished_refs.insert(refs.back().name);
+            if (finished_refs.count(chrom)) {
+                throw std::runtime_error("Cannot index output: chromosome " + chrom + " is not contiguous");
+            }
+            refs.push_back(Reference());
+            refs.back().name = chrom;
+            refs.back().first_offset = start;
+        }
+        
+        Reference& ref = refs.back();
+        if (begin < ref.last_pos) {
+            throw std::runtime_error("Cannot index output: positions on " + chrom + " are not sorted");
+        }
+        if (end <= begin) end = begin + 1;
+        if (end > (int64_t(1) << (MIN_SHIFT + 3 * depth))) {
+            throw std::runtime_error(std::string("Cannot index output: position beyond index range") +
+                                     (csi ? "" : " (try --index csi)"));
+        }
+        ref.last_pos = begin;
+        ref.last_offset = stop;
+        ref.records++;
+        
+        std::vector<Chunk>& chunks = ref.bins[reg2bin(begin, end, MIN_SHIFT, depth)];
+        if (!chunks.empty() && chunks.back().end == start) {
+            chunks.back().end = stop;
+        } else {
+            chunks.push_back({start, stop});
+        }
+        
+        size_t last_window = (end - 1) >> MIN_SHIFT;
+        if (ref.linear.size() <= last_window) {
+            ref.linear.resize(last_window + 1, UINT64_MAX);
+        }
+        for (size_t w = begin >> MIN_SHIFT; w <= last_window; w++) {
+            if (ref.linear[w] == UINT64_MAX) ref.linear[w] = start;
+        }
+    }
+    
+    // Parse CHROM, POS, REF and INFO/END of a data line and add it
+    void add_line(const char* line, size_t len, uint64_t start, uint64_t stop) {
+        std::string chrom;
+        int64_t begin, end;
+        if (!record_span(line, len, chrom, begin, end)) {
+            throw std::runtime_error("Cannot index output: malformed record");
+        }
+        add(chrom, begin, end, start, stop);
+    }
+    
+    void write(const std::string& filename, const BgzfWriter& data) {
+        std::string out;
+        
+        // Tabix-style settings: VCF format, CHROM/POS columns, '#' comments
+        std::string names;
+        for (const Reference& ref : refs) {
+            names += ref.name;
+            names += '\0';
+        }
+        std::string settings;
+        put32(settings, 2);
+        put32(settings, 1);
+        put32(settings, 2);
+        put32(settings, 0);
+        put32(settings, '#');
+        put32(settings, 0);
+        put32(settings, static_cast<uint32_t>(names.size()));
+        settings += names;
+        
+        if (csi) {
+            out.append("CSI\1", 4);
+            put32(out, MIN_SHIFT);
+            put32(out, depth);
+            put32(out, static_cast<uint32_t>(settings.size()));
+            out += settings;
+            put32(out, static_cast<uint32_t>(refs.size()));
+        } else {
+            out.append("TBI\1", 4);
+            put32(out, static_cast<uint32_t>(refs.size()));
+            out += settings;
+        }
+        
+        for (Reference& ref : refs) {
+            // Windows without a record of their own inherit the previous start
+            uint64_t previous = ref.first_offset;
+            for (uint64_t& offset : ref.linear) {
+                if (offset == UINT64_MAX) offset = previous;
+                previous = offset;
+            }
+            
+            put32(out, static_cast<uint32_t>(ref.bins.size() + 1));
+            for (const auto& bin : ref.bins) {
+                put32(out, bin.first);
+                if (csi) {
+                    size_t window = bin_start(bin.first, MIN_SHIFT, depth) >> MIN_SHIFT;
+                    uint64_t loffset = window < ref.linear.size() ? ref.linear[window] : ref.first_offset;
+                    put64(out, data.virtual_offset(loffset));
+                }
+                put32(out, static_cast<uint32_t>(bin.second.size()));
+                for (const Chunk& chunk : bin.second) {
+                    put64(out, data.virtual_offset(chunk.begin));
+                    put64(out, data.virtual_offset(chunk.end));
+                }
+            }
+            
+            // Pseudo-bin with the reference's extent and record counts
+            put32(out, pseudo_bin(depth));
+            if (csi) put64(out, 0);
+            put32(out, 2);
+            put64(out, data.virtual_offset(ref.first_offset));
+            put64(out, data.virtual_offset(ref.last_offset));
+            put64(out, ref.records);
+            put64(out, 0);
+            
+            if (!csi) {
+                put32(out, static_cast<uint32_t>(ref.linear.size()));
+                for (uint64_t offset : ref.linear) {
+                    put64(out, data.virtual_offset(offset));
+                }
+            }
+        }
+        
+        BgzfWriter index(filename, 1);
+        index.write(out.data(), out.size());
+        index.close();
+    }
+};
+
+// Range of BGZF virtual offsets [begin, end)
+struct VirtualSpan {
+    uint64_t begin;
+    uint64_t end;
+};
+
+// Reads a tbi or csi index and turns --regions into the sorted, merged list
+// of virtual-offset spans holding the records that may overlap them
+class IndexReader {
+private:
+    struct Chunk {
+        uint64_t begin;
+        uint64_t end;
+    };
+    
+    struct Reference {
+        std::map<uint32_t, std::vector<Chunk>> bins;
+        std::vector<uint64_t> linear;  // tbi only: first record per 16 kb window
+    };
+    
+    int min_shift = 14;
+    int depth = 5;
+    std::unordered_map<std::string, size_t> ref_ids;
+    std::vector<Reference> refs;
+    std::string data;
+    size_t pos = 0;
+    
+    const char* take(size_t n) {
+        if (data.size() - pos < n) {
+            throw std::runtime_error("Truncated index file");
+        }
+        pos += n;
+        return data.data() + pos - n;
+    }
+    
+    uint32_t get32() { return le32(reinterpret_cast<const unsigned char*>(take(4))); }
+    
+    uint64_t get64() {
+        uint64_t low = get32();
+        return low | static_cast<uint64_t>(get32()) << 32;
+    }
+    
+    // Tabix settings block shared by both formats; only the names matter here
+    void read_settings() {
+        take(24); // format, col_seq, col_beg, col_end, meta, skip
+        uint32_t l_nm = get32();
+        const char* names = take(l_nm);
+        for (const char* name = names; name < names + l_nm; name += strlen(name) + 1) {
+            size_t id = ref_ids.size();
+            ref_ids.emplace(name, id);
+        }
+    }
+
+public:
+    explicit IndexReader(const std::string& filename) {
+        gzFile file = gzopen(filename.c_str(), "rb");
+        if (!file) {
+            throw std::runtime_error("Cannot open index file: " + filename);
+        }
+        char buffer[1 << 16];
+        int n;
+        while ((n = gzread(file, buffer, sizeof(buffer))) > 0) {
+            data.append(buffer, n);
+        }
+        gzclose(file);
+        if (n < 0) {
+            throw std::runtime_error("Cannot read index file: " + filename);
+        }
+        
+        bool csi = data.compare(0, 4, "CSI\1", 4) == 0;
+        if (!csi && data.compare(0, 4, "TBI\1", 4) != 0) {
+            throw std::runtime_error("Not a tbi or csi index: " + filename);
+        }
+        take(4);
+        
+        uint32_t n_ref;
+        if (csi) {
+            min_shift = get32();
+            depth = get32();
+            uint32_t l_aux = get32();
+            if (l_aux < 28) {
+                throw std::runtime_error("CSI index has no sequence names: " + filename);
+            }
+            size_t aux_end = pos + l_aux;
+            read_settings();
+            pos = aux_end;
+            n_ref = get32();
+        } else {
+            n_ref = get32();
+            read_settings();
+        }
+        
+        refs.resize(n_ref);
+        uint32_t pseudo = pseudo_bin(depth);
+        for (Reference& ref : refs) {
+            uint32_t n_bin = get32();
+            for (uint32_t b = 0; b < n_bin; b++) {
+                uint32_t bin = get32();
+                if (csi) get64(); // loffset
+                uint32_t n_chunk = get32();
+                std::vector<Chunk>& chunks = ref.bins[bin];
+                for (uint32_t c = 0; c < n_chunk; c++) {
+                    uint64_t begin = get64();
+                    chunks.push_back({begin, get64()});
+                }
+                if (bin == pseudo) ref.bins.erase(bin);
+            }
+            if (!csi) {
+                uint32_t n_intv = get32();
+                for (uint32_t i = 0; i < n_intv; i++) ref.linear.push_back(get64());
+            }
+        }
+    }
+    
+    std::vector<VirtualSpan> find_spans(const RegionSet& regions) const {
+        std::vector<VirtualSpan> spans;
+        std::vector<uint32_t> bins;
+        int64_t max_coordinate = int64_t(1) << (min_shift + 3 * depth);
+        for (const std::string& chrom : regions.chromosomes()) {
+            auto id = ref_ids.find(chrom);
+            if (id == ref_ids.end() || id->second >= refs.size()) continue;
+            const Reference& ref = refs[id->second];
+            
+            for (const RegionSet::Range& range : *regions.find(chrom)) {
+                int64_t begin = std::min(range.begin - 1, max_coordinate - 1);
+                int64_t end = std::min(range.end, max_coordinate);
+                
+                // Chunks ending before the first record of the start window
+                // cannot hold anything at or past begin
+                uint64_t min_offset = 0;
+                if (!ref.linear.empty()) {
+                    size_t window = std::min<size_t>(begin >> min_shift, ref.linear.size() - 1);
+                    min_offset = ref.linear[window];
+                }
+                
+                bins.clear();
+                reg2bins(begin, end, min_shift, depth, bins);
+                for (uint32_t bin : bins) {
+                    auto it = ref.bins.find(bin);
+                    if (it == ref.bins.end()) continue;
+                    for (const Chunk& chunk : it->second) {
+                        if (chunk.end > min_offset) spans.push_back({chunk.begin, chunk.end});
+                    }
+                }
+            }
+        }
+        
+        std::sort(spans.begin(), spans.end(),
+                  [](const VirtualSpan& a, const VirtualSpan& b) { return a.begin < b.begin; });
+        std::vector<VirtualSpan> merged;
+        for (const VirtualSpan& span : spans) {
+            if (!merged.empty() && span.begin <= merged.back().end) {
+                merged.back().end = std::max(merged.back().end, span.end);
+            } else {
+                merged.push_back(span);
+            }
+        }
+        return merged;
+    }
+};
+
+// Pipeline counters for --stats. Each stage adds to them once per batch, and
+// the waits around every queue handoff are summed in nanoseconds of thread
+// time, so a stage that mostly waits on its input points at the stage before
+struct PipelineStats {
+    static const int DEPTH_BUCKETS = 8;  // Input queue depth 0, 1, 2-3, 4-7, ..., 64+
+    std::atomic<uint64_t> input_bytes{0};       // Text read, after decompression
+    std::atomic<uint64_t> records{0};           // Data lines; header lines are not counted
+    std::atomic<uint64_t> batches{0};
+    std::atomic<uint64_t> reader_queue_ns{0};   // Reader waiting for room in the input queue
+    std::atomic<uint64_t> reader_budget_ns{0};  // Reader waiting on --max-memory
+    std::atomic<uint64_t> worker_input_ns{0};   // Workers waiting for a batch
+    std::atomic<uint64_t> worker_window_ns{0};  // Workers waiting for a writer's reorder window
+    std::atomic<uint64_t> writer_wait_ns{0};    // Writers waiting for the next batch in order
+    std::atomic<uint64_t> queue_depth[DEPTH_BUCKETS];
+    
+    PipelineStats() {
+        for (auto& bucket : queue_depth) bucket.store(0);
+    }
+    
+    void add_queue_depth(size_t depth) {
+        int bucket = 0;
+        while (depth > 0 && bucket + 1 < DEPTH_BUCKETS) {
+            depth >>= 1;
+            bucket++;
+        }
+        queue_depth[bucket]++;
+    }
+};
+
+// Adds the lifetime of a scope to a PipelineStats counter
+class WaitTimer {
+private:
+    std::atomic<uint64_t>& total;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit WaitTimer(std::atomic<uint64_t>& total) : total(total), start(std::chrono::steady_clock::now()) {}
+    
+    ~WaitTimer() {
+        total += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+// Command line settings for one filtering run
+struct FilterOptions {
+    std::string input_file;
+    std::vector<std::pair<std::string, std::string>> cohorts;  // (sample file, output file)
+    bool exclude_samples = false;  // Sample lists name samples to drop
+    bool sample_order = false;     // Output samples in sample-file order
+    bool compress_output = false;
+    std::string output_format = "vcf";  // "vcf" or "bed" (PLINK .bed/.bim/.fam)
+    int thread_budget = 0;      // -t auto: threads shared by all stages, 0 = fixed counts
+    bool stats = false;         // Periodic rates and a JSON summary on stderr
+    int num_threads = 1;
+    int inflate_threads = 0;    // 0 = same as num_threads
+    int deflate_threads = 0;    // 0 = same as num_threads
+    std::string index_format;   // "tbi", "csi" or empty for no index
+    bool use_mmap = false;      // Map uncompressed input instead of reading it
+    bool split_input = false;   // Filter byte ranges of mapped input independently
+    size_t max_memory = 0;      // Byte budget for queued batches, 0 = unlimited
+    std::vector<std::string> format_fields;  // --format-fields keys, empty keeps all
+    bool fill_tags = false;     // Rewrite INFO AC/AN/AF for the selected samples
+    std::string regions;        // --regions list or file
+    int min_ac = 0;
+    bool exclude_monomorphic = false;
+    std::string checkpoint_file;  // --checkpoint: resume state, empty for none
+};
+
+// Sequential line source over the input file
+class LineReader {
+public:
+    virtual ~LineReader() {}
+    virtual bool next_line(std::string& line) = 0;
+    
+    // --checkpoint: where the next unread byte is, as a value seek() takes
+    // back (a byte offset, or a BGZF virtual offset)
+    virtual uint64_t tell() const {
+        throw std::runtime_error("--checkpoint needs uncompressed or BGZF input read from a file");
+    }
+    virtual void seek(uint64_t) {
+        throw std::runtime_error("--checkpoint needs uncompressed or BGZF input read from a file");
+    }
+    
+    // Append whole lines, each newline-terminated, until about max bytes
+    // (at least one line); false once the input is exhausted
+    virtual bool read_lines(std::string& out, size_t max) {
+        size_t start = out.size();
+        std::string line;
+        while (out.size() - start < max && next_line(line)) {
+            out += line;
+            out += '\n';
+        }
+        return out.size() > start;
+    }
+};
+
+// Splits lines of any length out of large blocks supplied by read_block();
+// newline offsets for a whole block are found in one delimiter-kernel pass
+class BlockLineReader : public LineReader {
+private:
+    static const size_t BLOCK_SIZE = 4 << 20;
+    std::vector<char> buffer;
+    size_t pos = 0;     // Start of the next line
+    size_t filled = 0;  // Valid bytes in buffer
+    std::vector<size_t> newlines;
+    size_t next_newline = 0;
+    bool at_eof = false;
+    uint64_t read_total = 0;  // Bytes ever returned by read_block()
+    
+    void refill() {
+        // Keep the unfinished tail; the buffer grows only for lines longer than a block
+        size_t rest = filled - pos;
+        if (rest) memmove(buffer.data(), buffer.data() + pos, rest);
+        pos = 0;
+        filled = rest;
+        if (buffer.size() < filled + BLOCK_SIZE) {
+            buffer.resize(filled + BLOCK_SIZE);
+        }
+        
+        newlines.clear();
+        next_newline = 0;
+        size_t n = read_block(buffer.data() + filled, BLOCK_SIZE);
+        read_total += n;
+        if (n == 0) {
+            at_eof = true;
+            return;
+        }
+        delimiter_kernel.find_all(buffer.data() + filled, n, '\n', filled, newlines, SIZE_MAX);
+        filled += n;
+    }
+
+protected:
+    // Read up to max bytes into dst; returns 0 at end of input
+    virtual size_t read_block(char* dst, size_t max) = 0;
+    
+    // Bytes of read_block() output handed out as lines or raw bytes
+    uint64_t consumed() const { return read_total - (filled - pos); }
+    
+    // Drop buffered input, e.g. before reading continues elsewhere in the file
+    void discard_buffered() {
+        pos = filled = 0;
+        newlines.clear();
+        next_newline = 0;
+        at_eof = false;
+    }
+
+public:
+    // Raw bytes for binary input (BCF): buffered data first, then blocks
+    // straight from read_block(). False if the input ends first
+    bool read_exact(char* dst, size_t n) {
+        size_t done = std::min(n, filled - pos);
+        if (done) memcpy(dst, buffer.data() + pos, done);
+        pos += done;
+        while (next_newline < newlines.size() && newlines[next_newline] < pos) next_newline++;
+        while (done < n) {
+            size_t got = read_block(dst + done, n - done);
+            read_total += got;
+            if (got == 0) return false;
+            done += got;
+        }
+        return true;
+    }
+    
+    bool next_line(std::string& line) override {
+        while (next_newline == newlines.size()) {
+            if (at_eof) {
+                if (pos == filled) return false;
+                line.assign(buffer.data() + pos, filled - pos); // Last line without newline
+                pos = filled;
+                return true;
+            }
+            refill();
+        }
+        
+        size_t end = newlines[next_newline++];
+        line.assign(buffer.data() + pos, end - pos);
+        pos = end + 1;
+        return true;
+    }
+    
+    // Copies runs of complete lines straight out of the block
+    bool read_lines(std::string& out, size_t max) override {
+        size_t start = out.size();
+        while (out.size() - start < max) {
+            if (next_newline == newlines.size()) {
+                if (at_eof) {
+                    if (pos < filled) {
+                        out.append(buffer.data() + pos, filled - pos); // Last line without newline
+                        out += '\n';
+                        pos = filled;
+                    }
+                    break;
+                }
+                refill();
+                continue;
+            }
+            
+            // Every pending line that still fits, and at least one
+            size_t room = max - (out.size() - start);
+            auto first = newlines.begin() + next_newline;
+            auto fit = std::upper_bound(first, newlines.end(), pos + room - 1);
+            size_t last = fit == first ? next_newline : fit - newlines.begin() - 1;
+            out.append(buffer.data() + pos, newlines[last] + 1 - pos);
+            pos = newlines[last] + 1;
+            next_newline = last + 1;
+        }
+        return out.size() > start;
+    }
+};
+
+// The raw bytes of the input: a file, or stdin for "-". The first bytes are
+// read up front so the format is sniffed from memory and then handed out
+// again, since a pipe can be neither reopened nor rewound
+class InputSource {
+private:
+    static const size_t HEAD_BYTES = 64 << 10;  // One whole BGZF block
+    FILE* file;
+    bool from_stdin;
+    std::vector<char> head;
+    size_t head_pos = 0;
+
+public:
+    explicit InputSource(const std::string& filename) : from_stdin(is_stdio(filename)) {
+        file = from_stdin ? stdin : fopen(filename.c_str(), "rb");
+        if (!file) {
+            throw std::runtime_error("Cannot open file: " + filename);
+        }
+#ifdef VSF_HAVE_MMAP
+        if (from_stdin) widen_pipe(fileno(stdin));
+#endif
+        head.resize(HEAD_BYTES);
+        head.resize(fread(head.data(), 1, head.size(), file));
+        if (ferror(file)) {
+            throw std::runtime_error("Read error on input file");
+        }
+    }
+    
+    ~InputSource() {
+        if (!from_stdin) fclose(file);
+    }
+    
+    InputSource(const InputSource&) = delete;
+    InputSource& operator=(const InputSource&) = delete;
+    
+    // The first bytes of the input (fewer if the input is shorter)
+    const std::vector<char>& peek() const { return head; }
+    
+    bool is_stdin() const { return from_stdin; }
+    
+    // Up to max bytes; fewer only at end of input
+    size_t read(char* dst, size_t max) {
+        size_t done = 0;
+        if (head_pos < head.size()) {
+            done = std::min(max, head.size() - head_pos);
+            memcpy(dst, head.data() + head_pos, done);
+            head_pos += done;
+        }
+        if (done < max) {
+            done += fread(dst + done, 1, max - done, file);
+            if (ferror(file)) {
+                throw std::runtime_error("Read error on input file");
+            }
+        }
+        return done;
+    }
+    
+    // Continue at a byte offset of a file
+    void seek(uint64_t offset) {
+        if (from_stdin) {
+            throw std::runtime_error("Cannot seek in stdin");
+        }
+        head_pos = head.size();
+        clearerr(file);
+#ifdef VSF_HAVE_MMAP
+        int ret = fseeko(file, static_cast<off_t>(offset), SEEK_SET);
+#else
+        int ret = fseek(file, static_cast<long>(offset), SEEK_SET);
+#endif
+        if (ret != 0) {
+            throw std::runtime_error("Seek error on input file");
+        }
+    }
+};
+
+// Streams gzip input through zlib. Concatenated members are read in turn,
+// and anything after the last member that is not gzip is ignored
+class GzLineReader : public BlockLineReader {
 private:
-    std::unordered_set<std::string> target_samples;
-    std::vector<int> sample_indices;
+    std::unique_ptr<InputSource> source;
+    std::vector<unsigned char> compressed;
+    z_stream zs;
+    bool source_done = false;
+    bool in_member = false;  // Inside a member: running out of input now means truncation
+    bool any_member = false; // At least one member ended
+    bool trailing = false;   // Non-gzip bytes followed the last member
+
+protected:
+    size_t read_block(char* dst, size_t max) override {
+        zs.next_out = reinterpret_cast<unsigned char*>(dst);
+        zs.avail_out = static_cast<uInt>(std::min<size_t>(max, UINT_MAX));
+        uInt room = zs.avail_out;
+        while (zs.avail_out == room && !trailing) {
+            if (zs.avail_in == 0) {
+                if (source_done) break;
+                size_t n = source->read(reinterpret_cast<char*>(compressed.data()), compressed.size());
+                if (n == 0) {
+                    source_done = true;
+                    break;
+                }
+                zs.next_in = compressed.data();
+                zs.avail_in = static_cast<uInt>(n);
+            }
+            
+            int ret = inflate(&zs, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                inflateReset(&zs);
+                in_member = false;
+                any_member = true;
+            } else if (ret == Z_DATA_ERROR && !in_member && any_member) {
+                trailing = true;
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                throw std::runtime_error(std::string("Decompression error: ") + (zs.msg ? zs.msg : "corrupt data"));
+            } else {
+                in_member = true;
+            }
+        }
+        if (zs.avail_out == room && source_done && in_member) {
+            throw std::runtime_error("Decompression error: truncated gzip input");
+        }
+        return room - zs.avail_out;
+    }
+
+public:
+    explicit GzLineReader(std::unique_ptr<InputSource> input)
+        : source(std::move(input)), compressed(1 << 20) {
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+            throw std::runtime_error("Cannot initialise inflate");
+        }
+    }
+    
+    ~GzLineReader() override { inflateEnd(&zs); }
+};
+
+// Reads BGZF input (independent gzip members carrying their size in the extra
+// field) and inflates groups of blocks on a pool of threads; the inflated
+// chunks are handed to the line splitter in file order
+class BgzfLineReader : public BlockLineReader {
+private:
+    struct Chunk {
+        std::vector<unsigned char> compressed;  // Whole BGZF blocks
+        std::vector<size_t> block_ends;         // End offset of each block in compressed
+        std::vector<uint64_t> block_offsets;    // File offset of each block
+        std::vector<size_t> block_data;         // Start of each block's bytes in data
+        size_t inflated = 0;
+        std::vector<char> data;
+        size_t begin = 0;   // Bytes of data to hand out: [begin, end)
+        size_t end = 0;
+        bool done = false;
+        std::string error;
+    };
+    
+    // Where a block's inflated bytes start in the stream handed out, for
+    // turning stream positions back into virtual offsets
+    struct BlockMark {
+        int64_t stream;  // Negative for a block entered part-way after seek()
+        uint64_t offset;
+    };
+    
+    static const size_t CHUNK_BYTES = 4 << 20;
+    std::unique_ptr<InputSource> file;
+    bool file_done = false;
+    
+    // With an index query, only these virtual-offset spans are read
+    std::vector<VirtualSpan> spans;
+    bool use_spans = false;
+    size_t span_index = 0;
+    bool in_span = false;
+    uint64_t file_pos = 0;  // Compressed offset of the next block
+    std::deque<std::shared_ptr<Chunk>> in_flight;  // File order; front is next to hand out
+    size_t window;
+    size_t front_pos = 0;
+    size_t skip = 0;              // Bytes of the next chunk's first block seek() passes over
+    uint64_t delivered = 0;       // Bytes returned by read_block()
+    std::deque<BlockMark> marks;  // Blocks handed out, oldest first
+    std::mutex mutex;
+    std::condition_variable done_cv;
+    size_t running = 0;  // Submitted chunks whose task has not finished
+    TaskPool own_pool;   // Declared last so it drains before the members its tasks use
+    TaskPool* pool;      // own_pool, or a pool shared with other stages
+    
+    // Append the next whole block to the chunk; returns its inflated size, or
+    // false at end of file
+    bool read_one_block(Chunk& chunk, size_t& isize) {
+        unsigned char header[BGZF_HEADER_SIZE];
+        size_t got = file->read(reinterpret_cast<char*>(header), sizeof(header));
+        if (got == 0) return false;
+        if (got != sizeof(header) || header[0] != 0x1f || header[1] != 0x8b ||
+            !(header[3] & 4) || header[12] != 'B' || header[13] != 'C') {
+            throw std::runtime_error("Malformed BGZF block header");
+        }
+        
+        size_t block_size = le16(header + 16) + 1;
+        size_t start = chunk.compressed.size();
+        chunk.compressed.resize(start + block_size);
+        memcpy(chunk.compressed.data() + start, header, sizeof(header));
+        if (file->read(reinterpret_cast<char*>(chunk.compressed.data() + start + sizeof(header)),
+                       block_size - sizeof(header)) != block_size - sizeof(header)) {
+            throw std::runtime_error("Truncated BGZF block");
+        }
+        
+        chunk.block_ends.push_back(start + block_size);
+        isize = le32(chunk.compressed.data() + start + block_size - 4);
+        if (isize > BGZF_MAX_BLOCK_SIZE) {
+            throw std::runtime_error("Oversized BGZF block");  // ISIZE sizes the output buffer
+        }
+        chunk.block_offsets.push_back(file_pos);
+        chunk.block_data.push_back(chunk.inflated);
+        chunk.inflated += isize;
+        file_pos += block_size;
+        return true;
+    }
+    
+    // Read whole blocks until the chunk would inflate to about CHUNK_BYTES
+    bool read_chunk(Chunk& chunk) {
+        if (use_spans) return read_span_chunk(chunk);
+        
+        size_t inflated = 0;
+        size_t isize;
+        while (inflated + BGZF_MAX_BLOCK_SIZE <= CHUNK_BYTES) {
+            if (!read_one_block(chunk, isize)) {
+                file_done = true;
+                break;
+            }
+            inflated += isize;
+        }
+        chunk.data.resize(inflated);
+        chunk.end = inflated;
+        chunk.begin = std::min(skip, inflated);
+        skip = 0;
+        return !chunk.block_ends.empty();
+    }
+    
+    // Index-driven variant: blocks come from the current span only, and the
+    // span's first and last blocks are trimmed to its virtual offsets
+    bool read_span_chunk(Chunk& chunk) {
+        while (span_index < spans.size()) {
+            const VirtualSpan& span = spans[span_index];
+            uint64_t last_block = span.end >> 16;
+            size_t last_bytes = span.end & 0xffff;
+            if (!in_span) {
+                file->seek(span.begin >> 16);
+                file_pos = span.begin >> 16;
+                chunk.begin = span.begin & 0xffff;
+                in_span = true;
+            }
+            
+            size_t inflated = 0;
+            size_t isize;
+            bool finished = false;
+            chunk.end = SIZE_MAX;
+            while (inflated + BGZF_MAX_BLOCK_SIZE <= CHUNK_BYTES) {
+                if (file_pos > last_block || (file_pos == last_block && last_bytes == 0)) {
+                    finished = true;
+                    break;
+                }
+                bool is_last = file_pos == last_block;
+                if (!read_one_block(chunk, isize)) {
+                    throw std::runtime_error("Index points past the end of the BGZF file");
+                }
+                if (is_last) {
+                    chunk.end = inflated + last_bytes;
+                    finished = true;
+                }
+                inflated += isize;
+                if (finished) break;
+            }
+            chunk.data.resize(inflated);
+            if (chunk.end == SIZE_MAX) chunk.end = inflated;
+            if (finished) {
+                span_index++;
+                in_span = false;
+            }
+            if (!chunk.block_ends.empty()) return true;
+            chunk.begin = 0;
+        }
+        file_done = true;
+        return false;
+    }
+    
+    // Raw-inflate every block of a chunk into its data buffer
+    static void inflate_chunk(Chunk& chunk) {
+        BlockInflater inflater;
+        size_t start = 0;
+        size_t out = 0;
+        for (size_t end : chunk.block_ends) {
+            const unsigned char* block = chunk.compressed.data() + start;
+            size_t xlen = le16(block + 10);
+            size_t isize = le32(block + (end - start) - 4);
+            
+            if (!inflater.decompress(block + 12 + xlen, end - start - 12 - xlen - BGZF_FOOTER_SIZE,
+                                     chunk.data.data() + out, isize)) {
+                throw std::runtime_error("Corrupt BGZF block");
+            }
+            if (block_crc32(chunk.data.data() + out, isize) != le32(block + (end - start) - 8)) {
+                throw std::runtime_error("BGZF block CRC mismatch");
+            }
+            
+            out += isize;
+            start = end;
+        }
+    }
+    
+    // Keep the pool busy with up to window chunks read ahead
+    void fill_window() {
+        while (!file_done && in_flight.size() < window) {
+            std::shared_ptr<Chunk> chunk(new Chunk);
+            if (!read_chunk(*chunk)) break;
+            
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                in_flight.push_back(chunk);
+                running++;
+            }
+            pool->submit([this, chunk] {
+                std::string error;
+                try {
+                    inflate_chunk(*chunk);
+                } catch (const std::exception& e) {
+                    error = e.what();
+                }
+                std::vector<unsigned char>().swap(chunk->compressed);
+                
+                std::lock_guard<std::mutex> lock(mutex);
+                chunk->error = error;
+                chunk->done = true;
+                running--;
+                done_cv.notify_all();
+            });
+        }
+    }
+
+protected:
+    size_t read_block(char* dst, size_t max) override {
+        while (true) {
+            fill_window();
+            if (in_flight.empty()) return 0;
+            
+            std::unique_lock<std::mutex> lock(mutex);
+            done_cv.wait(lock, [this] { return in_flight.front()->done; });
+            std::shared_ptr<Chunk> chunk = in_flight.front();
+            lock.unlock();
+            
+            if (!chunk->error.empty()) {
+                throw std::runtime_error(chunk->error);
+            }
+            
+            if (front_pos < chunk->begin) front_pos = chunk->begin;
+            if (front_pos == chunk->begin) {
+                // Only blocks holding unconsumed bytes can be asked about
+                int64_t pos = static_cast<int64_t>(consumed());
+                while (marks.size() > 1 && marks[1].stream <= pos) marks.pop_front();
+                for (size_t b = 0; b < chunk->block_offsets.size(); b++) {
+                    int64_t stream = static_cast<int64_t>(delivered + chunk->block_data[b]) - chunk->begin;
+                    marks.push_back({stream, chunk->block_offsets[b]});
+                }
+            }
+            size_t n = std::min(max, chunk->end - front_pos);
+            memcpy(dst, chunk->data.data() + front_pos, n);
+            front_pos += n;
+            delivered += n;
+            if (front_pos == chunk->end) {
+                lock.lock();
+                in_flight.pop_front();
+                lock.unlock();
+                front_pos = 0;
+            }
+            if (n > 0) return n; // Empty chunks (EOF marker blocks) are skipped
+        }
+    }
+
+public:
+    // With a shared pool, threads only sizes the read-ahead window
+    BgzfLineReader(std::unique_ptr<InputSource> input, int threads, TaskPool* shared_pool = nullptr)
+        : file(std::move(input)), window(2 * threads), own_pool(shared_pool ? 0 : threads),
+          pool(shared_pool ? shared_pool : &own_pool) {}
+    
+    // A shared pool outlives the reader; wait out tasks still using it
+    ~BgzfLineReader() override {
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [this] { return running == 0; });
+    }
+    
+    // Virtual offset of the next unread byte
+    uint64_t tell() const override {
+        int64_t pos = static_cast<int64_t>(consumed());
+        if (marks.empty()) return file_pos << 16;
+        size_t b = 0;
+        while (b + 1 < marks.size() && marks[b + 1].stream <= pos) b++;
+        return marks[b].offset << 16 | static_cast<uint64_t>(pos - marks[b].stream);
+    }
+    
+    // Continue reading at a virtual offset, dropping whatever was read ahead
+    void seek(uint64_t voffset) override {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            in_flight.clear();  // Running inflate tasks keep their chunk alive
+        }
+        discard_buffered();
+        front_pos = 0;
+        use_spans = false;
+        file_done = false;
+        file->seek(voffset >> 16);
+        file_pos = voffset >> 16;
+        skip = voffset & 0xffff;
+        marks.clear();
+    }
+    
+    // Continue with only the given spans (sorted, non-overlapping), dropping
+    // whatever was read ahead; lines already returned are unaffected
+    void restrict_to(const std::vector<VirtualSpan>& index_spans) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            in_flight.clear();  // Running inflate tasks keep their chunk alive
+        }
+        discard_buffered();
+        front_pos = 0;
+        spans = index_spans;
+        use_spans = true;
+        span_index = 0;
+        in_span = false;
+        file_done = false;
+    }
+};
+
+class PlainLineReader : public BlockLineReader {
+private:
+    std::unique_ptr<InputSource> file;
+    uint64_t origin = 0;  // File offset of consumed() == 0
+
+protected:
+    size_t read_block(char* dst, size_t max) override { return file->read(dst, max); }
+
+public:
+    explicit PlainLineReader(std::unique_ptr<InputSource> input) : file(std::move(input)) {}
+    
+    uint64_t tell() const override {
+        if (file->is_stdin()) return LineReader::tell();
+        return origin + consumed();
+    }
+    
+    void seek(uint64_t position) override {
+        file->seek(position);
+        discard_buffered();
+        origin = position - consumed();
+    }
+};
+
+#ifdef VSF_HAVE_MMAP
+// Maps an uncompressed input file so batches can be whole-line ranges of
+// the mapping instead of copies
+class MmapLineReader : public LineReader {
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+    size_t pos = 0;
+
+public:
+    explicit MmapLineReader(const std::string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open file: " + filename);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            ::close(fd);
+            throw std::runtime_error("Cannot map non-regular file: " + filename);
+        }
+        
+        size = st.st_size;
+        if (size > 0) {
+            void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Cannot map file: " + filename);
+            }
+            madvise(map, size, MADV_SEQUENTIAL);
+            data = static_cast<const char*>(map);
+        }
+        ::close(fd);
+    }
+    
+    ~MmapLineReader() {
+        if (data) munmap(const_cast<char*>(data), size);
+    }
+    
+    bool next_line(std::string& line) override {
+        if (pos == size) return false;
+        const char* nl = static_cast<const char*>(memchr(data + pos, '\n', size - pos));
+        size_t end = nl ? nl - data : size;
+        line.assign(data + pos, end - pos);
+        pos = nl ? end + 1 : size;
+        return true;
+    }
+    
+    // Everything not yet read
+    const char* remaining(size_t& len) const {
+        len = size - pos;
+        return data + pos;
+    }
+    
+    uint64_t tell() const override { return pos; }
+    void seek(uint64_t position) override { pos = std::min<uint64_t>(position, size); }
+    
+    // Next range of whole lines of about max bytes (more for a longer line)
+    bool next_range(size_t max, const char*& text, size_t& len) {
+        if (pos == size) return false;
+        size_t end = size;
+        if (size - pos > max) {
+            const char* nl = static_cast<const char*>(memchr(data + pos + max, '\n', size - pos - max));
+            if (nl) end = nl - data + 1;
+        }
+        text = data + pos;
+        len = end - pos;
+        pos = end;
+        return true;
+    }
+};
+#endif
+
+// --checkpoint file operations; without POSIX calls checkpointing is
+// rejected before a run starts
+#ifdef VSF_HAVE_MMAP
+static bool sync_file(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool ok = fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+static bool truncate_file(const std::string& path, uint64_t size) {
+    return truncate(path.c_str(), static_cast<off_t>(size)) == 0;
+}
+#else
+static bool sync_file(const std::string&) { return false; }
+static bool truncate_file(const std::string&, uint64_t) { return false; }
+#endif
+
+// --checkpoint: every few batches each writer makes its output durable up to
+// the end of one batch and reports its length. Once every output has
+// reported the same batch, the checkpoint file is replaced by one holding
+// the input position after that batch and each output's length, so a rerun
+// can cut the outputs back to those lengths and read on from there
+class Checkpoint {
+public:
+    struct State {
+        uint64_t input_position = 0;  // Byte or BGZF virtual offset after the batch
+        uint64_t lines = 0;
+        std::vector<uint64_t> output_sizes;
+    };
+
+private:
+    struct Pending {
+        size_t reported = 0;
+        State state;
+    };
+    
+    std::string path;
     std::string input_file;
-    std::string output_file;
-    std::string sample_file;
-    bool compress_output;
-    int num_threads;
-    
-    // Thread-safe queues with size limits to prevent memory overflow
-    static const size_t MAX_QUEUE_SIZE = 1000;
-    std::queue<std::string> input_queue;
-    std::queue<std::string> output_queue;
-    std::mutex input_mutex;
-    std::mutex output_mutex;
-    std::condition_variable input_cv;
-    std::condition_variable output_cv;
-    std::atomic<bool> finished_reading{false};
-    std::atomic<bool> finished_processing{false};
+    std::vector<std::string> output_files;
+    std::mutex mutex;
+    std::map<size_t, Pending> pending;  // By batch
+    
+    // Write a new file beside the old one, then rename it over
+    void save(const State& state) {
+        std::string temp = path + ".tmp";
+        std::ofstream out(temp);
+        out << "VSF checkpoint 1\n";
+        out << "input " << state.input_position << ' ' << state.lines << ' ' << input_file << '\n';
+        for (size_t i = 0; i < output_files.size(); i++) {
+            out << "output " << state.output_sizes[i] << ' ' << output_files[i] << '\n';
+        }
+        out.close();
+        if (!out || !sync_file(temp) || std::rename(temp.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("Cannot write checkpoint " + path);
+        }
+    }
+
+public:
+    Checkpoint(const std::string& path, const std::string& input_file,
+               const std::vector<std::string>& output_files)
+        : path(path), input_file(input_file), output_files(output_files) {}
+    
+    // State saved by an earlier run with the same input and outputs; false
+    // when there is no checkpoint yet
+    bool load(State& state) const {
+        std::ifstream in(path);
+        if (!in) return false;
+        
+        std::string line;
+        std::getline(in, line);
+        if (line != "VSF checkpoint 1") {
+            throw std::runtime_error("Not a checkpoint file: " + path);
+        }
+        size_t outputs = 0;
+        bool matches = true;
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            std::string kind, name;
+            uint64_t value = 0;
+            fields >> kind >> value;
+            if (kind == "input") fields >> state.lines;
+            fields.get();
+            std::getline(fields, name);
+            if (kind == "input") {
+                state.input_position = value;
+                matches = matches && name == input_file;
+            } else if (kind == "output") {
+                matches = matches && outputs < output_files.size() && name == output_files[outputs++];
+                state.output_sizes.push_back(value);
+            }
+        }
+        if (!matches || outputs != output_files.size()) {
+            throw std::runtime_error("Checkpoint " + path + " was written for a different input or outputs");
+        }
+        return true;
+    }
+    
+    // Output number output holds everything through batch seq in its first
+    // size bytes, durably
+    void commit(size_t seq, size_t output, uint64_t input_position, uint64_t lines, uint64_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Pending& entry = pending[seq];
+        entry.state.input_position = input_position;
+        entry.state.lines = lines;
+        entry.state.output_sizes.resize(output_files.size());
+        entry.state.output_sizes[output] = size;
+        if (++entry.reported < output_files.size()) return;
+        
+        save(entry.state);
+        pending.erase(seq);
+    }
+    
+    // A finished run leaves nothing to resume
+    void remove() { std::remove(path.c_str()); }
+};
+
+class VCFSampleFilter {
+    friend class Benchmark;
+
+private:
+    // Inflate and every cohort's deflate run on one shared pool, so
+    // threads idle in one codec pick up the other's blocks. Declared before
+    // input so the reader and writers are gone before it stops
+    ThreadGate codec_gate;
+    std::unique_ptr<TaskPool> codec_pool;
+    std::unique_ptr<LineReader> input;
+#ifdef VSF_HAVE_MMAP
+    MmapLineReader* mapped_input = nullptr;  // Set when input is the mapped reader
+#endif
+    BlockLineReader* bcf_input = nullptr;  // Set when input is BCF; batches hold whole records
+    FilterOptions options;
+    
+    // Lock-free bounded queues with size limits to prevent memory overflow.
+    // Lines travel in batches so each handoff is one queue operation per batch;
+    // finished batches wait in output_batches until their turn to be written.
+    // With --max-memory, memory_budget also caps the bytes held by batches from
+    // the moment the reader fills them until the writer has written them.
+    // Input and output buffers go back to their pools once consumed and are
+    // handed out again for later batches.
+    static const size_t MAX_QUEUE_SIZE = 64;
+    static const size_t BATCH_BYTES = 4 << 20;
+    size_t batch_bytes = BATCH_BYTES;
+    BoundedQueue<LineBatch> input_queue{MAX_QUEUE_SIZE};
+    ByteBudget memory_budget;
+    BufferPool input_buffers{MAX_QUEUE_SIZE, 2 * BATCH_BYTES};
+    BufferPool output_buffers{MAX_QUEUE_SIZE * options.cohorts.size(), 2 * BATCH_BYTES};
+    
+    // One sample list and its output. Every cohort is cut from the same
+    // records in one pass: the input is inflated and each line's tabs are
+    // scanned once, then each cohort's plan copies its own columns into its
+    // own batch output, which its own writer drains in order
+    struct Cohort {
+        std::string sample_file;
+        std::string output_file;
+        bool exclude = false;  // The list names samples to drop, not to keep
+        std::unordered_set<std::string> target_samples;
+        std::vector<std::string> sample_order;  // target_samples as listed in the file
+        SelectionPlan plan;
+        ReorderRing<LineBatch> output_batches{MAX_QUEUE_SIZE};
+        std::atomic<size_t> sites_dropped{0};
+        std::atomic<size_t> bed_skipped{0};  // Not biallelic, or too few columns
+        std::atomic<uint64_t> bytes_written{0};  // Before compression
+        uint64_t lines_written = 0;  // --checkpoint: input lines behind the output so far
+    };
+    std::vector<std::unique_ptr<Cohort>> cohorts;
+    int scan_columns = 0;  // Tabs are scanned up to the highest last_column of any cohort
+    RegionSet regions;     // Sites to keep by CHROM/POS; empty keeps all
+    std::atomic<bool> failed{false};
     std::atomic<size_t> lines_processed{0};
+    size_t batches_read = 0;
+    
+    // With -t auto the monitor moves permits between the codec pool's gate
+    // and the workers'; otherwise they never limit anything
+    bool inflating = false;  // Input is BGZF, inflated on the codec pool
+    ThreadGate worker_gate;
+    int codec_permits = 0;
+    int worker_permits = 0;
+    
+    // --checkpoint: writers report every CHECKPOINT_BATCHES batches; resume
+    // is what an earlier run had committed when resuming is set
+    static const size_t CHECKPOINT_BATCHES = 64;
+    std::unique_ptr<Checkpoint> checkpoint;
+    Checkpoint::State resume;
+    bool resuming = false;
+    
+    // Progress on stdout, or --stats on stderr, from one monitor thread
+    PipelineStats stats;
+    std::mutex monitor_mutex;
+    std::condition_variable monitor_cv;
+    bool monitor_done = false;
+    
+    // The input format is sniffed from the first bytes InputSource already
+    // holds, so stdin works the same as a file
+    static bool is_gzipped(const std::vector<char>& head) {
+        return head.size() >= 2 && static_cast<unsigned char>(head[0]) == 0x1f &&
+               static_cast<unsigned char>(head[1]) == 0x8b;
+    }
+    
+    // BGZF: gzip with a 'BC' subfield holding the block size
+    static bool is_bgzf(const std::vector<char>& head) {
+        const unsigned char* header = reinterpret_cast<const unsigned char*>(head.data());
+        return head.size() >= BGZF_HEADER_SIZE && is_gzipped(head) && (header[3] & 4) &&
+               header[12] == 'B' && header[13] == 'C' && header[14] == 2 && header[15] == 0;
+    }
+    
+    // BCF, compressed or not; a compressed head is inflated just far enough
+    static bool is_bcf(const std::vector<char>& head) {
+        char magic[3];
+        size_t n = std::min(head.size(), sizeof(magic));
+        if (is_gzipped(head)) {
+            z_stream zs;
+            memset(&zs, 0, sizeof(zs));
+            if (inflateInit2(&zs, 15 + 16) != Z_OK) return false;
+            zs.next_in = reinterpret_cast<unsigned char*>(const_cast<char*>(head.data()));
+            zs.avail_in = static_cast<uInt>(head.size());
+            zs.next_out = reinterpret_cast<unsigned char*>(magic);
+            zs.avail_out = sizeof(magic);
+            inflate(&zs, Z_SYNC_FLUSH);
+            n = sizeof(magic) - zs.avail_out;
+            inflateEnd(&zs);
+        } else {
+            memcpy(magic, head.data(), n);
+        }
+        return n == sizeof(magic) && memcmp(magic, BCF_MAGIC, sizeof(magic)) == 0;
+    }
+    
+    // Load sample names from file
+    void load_samples(Cohort& cohort) {
+        std::unordered_set<std::string>& target_samples = cohort.target_samples;
+        std::ifstream file(cohort.sample_file);
+        if (!file) {
+            throw std::runtime_error("Cannot open sample file: " + cohort.sample_file);
+        }
+        
+        std::string sample;
+        while (std::getline(file, sample)) {
+            // Remove whitespace
+            sample.erase(std::remove_if(sample.begin(), sample.end(), ::isspace), sample.end());
+            if (!sample.empty() && target_samples.insert(sample).second) {
+                cohort.sample_order.push_back(sample);
+            }
+        }
+        
+        if (target_samples.empty()) {
+            throw std::runtime_error("No samples found in sample file " + cohort.sample_file);
+        }
+        
+        std::cout << "Loaded " << target_samples.size() << (cohort.exclude ? " excluded" : " target")
+                  << " samples from " << cohort.sample_file << std::endl;
+    }
+    
+    // Parse the #CHROM line and fill in a cohort's selection plan
+    void process_header(Cohort& cohort, const std::string& header_line) {
+        const std::unordered_set<std::string>& target_samples = cohort.target_samples;
+        SelectionPlan& plan = cohort.plan;
+        std::istringstream iss(header_line);
+        std::string token;
+        std::vector<std::string> fields;
+        
+        while (std::getline(iss, token, '\t')) {
+            fields.push_back(token);
+        }
+        
+        // Find FORMAT column (should be at index 8)
+        int format_idx = -1;
+        for (size_t i = 0; i < fields.size(); i++) {
+            if (fields[i] == "FORMAT") {
+                format_idx = static_cast<int>(i);
+                break;
+            }
+        }
+        
+        if (format_idx == -1) {
+            throw std::runtime_error("FORMAT column not found in header");
+        }
+        
+        // Sample columns start after FORMAT. Selected columns follow the VCF
+        // unless --sample-order asks for the order of the sample file
+        std::vector<std::string> output_fields(fields.begin(), fields.begin() + format_idx + 1);
+        
+        if (options.sample_order && !cohort.exclude) {
+            std::unordered_map<std::string, int> columns;
+            for (size_t i = format_idx + 1; i < fields.size(); i++) {
+                columns.emplace(fields[i], static_cast<int>(i));
+            }
+            for (const std::string& sample : cohort.sample_order) {
+                auto column = columns.find(sample);
+                if (column != columns.end()) plan.sample_indices.push_back(column->second);
+            }
+        } else {
+            for (size_t i = format_idx + 1; i < fields.size(); i++) {
+                if (target_samples.count(fields[i]) != cohort.exclude) {
+                    plan.sample_indices.push_back(static_cast<int>(i));
+                }
+            }
+        }
+        for (int idx : plan.sample_indices) {
+            output_fields.push_back(fields[idx]);
+            plan.sample_names.push_back(fields[idx]);
+        }
+        
+        if (plan.sample_indices.empty()) {
+            throw std::runtime_error(cohort.exclude ? "Every sample is excluded by " + cohort.sample_file
+                                                    : "No matching samples from " + cohort.sample_file + " found in VCF header");
+        }
+        
+        // Columns adjacent in both input and output merge into one copy run,
+        // so an exclusion list compiles to a few long runs
+        for (int idx : plan.sample_indices) {
+            if (!plan.runs.empty() && plan.runs.back().first + plan.runs.back().count == idx) {
+                plan.runs.back().count++;
+            } else {
+                plan.runs.push_back({idx, 1});
+            }
+        }
+        plan.last_column = *std::max_element(plan.sample_indices.begin(), plan.sample_indices.end());
+        plan.format_fields = options.format_fields;
+        plan.fill_tags = options.fill_tags;
+        plan.min_ac = options.min_ac;
+        plan.exclude_monomorphic = options.exclude_monomorphic;
+        plan.plink_bed = options.output_format == "bed";
+        
+        std::cout << "Found " << plan.sample_indices.size() << " matching samples out of " 
+                  << (fields.size() - format_idx - 1) << " total samples for " << cohort.output_file
+                  << " (" << plan.runs.size() << " copy runs)" << std::endl;
+        
+        // Reconstruct header line
+        std::ostringstream oss;
+        for (size_t i = 0; i < output_fields.size(); i++) {
+            if (i > 0) oss << "\t";
+            oss << output_fields[i];
+        }
+        oss << "\n";
+        
+        plan.header += oss.str();
+        plan.output_columns = output_fields.size();
+    }
+    
+    // Shared part of every cohort's work on a data line: the region check,
+    // then one kernel pass finding tabs up to the last column any cohort
+    // selects. Returns false when the record is outside --regions
+    bool scan_record(const char* base, size_t len, RecordScratch& scratch) const {
+        // Region rejects only look at CHROM and POS
+        if (!regions.empty() && !in_regions(base, len, scratch)) {
+            return false;
+        }
+        
+        // tabs[i] is the end offset of field i; field i starts at tabs[i - 1] + 1.
+        // The scan stops once the tab ending scan_columns is found
+        std::vector<size_t>& tabs = scratch.tabs;
+        tabs.clear();
+        delimiter_kernel.find_all(base, len, '\t', 0, tabs, scan_columns + 1);
+        if (tabs.size() <= static_cast<size_t>(scan_columns)) {
+            tabs.push_back(len); // Scanned to end of line
+        }
+        return true;
+    }
+    
+    // Process a scanned data line for one cohort: append the fixed columns and
+    // each run of selected samples to result.output as whole byte ranges.
+    // Returns false, writing nothing, when a site filter drops the record or
+    // bed output cannot hold it (then scratch.skipped_for_bed is set)
+    bool process_data_line(const SelectionPlan& plan, const char* base, size_t len,
+                           RecordScratch& scratch, LineBatch& result) const {
+        const std::vector<size_t>& tabs = scratch.tabs;
+        std::string& out = result.output;
+        scratch.skipped_for_bed = false;
+        if (tabs.size() < 9) {
+            if (plan.plink_bed) {
+                scratch.skipped_for_bed = true;
+                return false;
+            }
+            out.append(base, len); // Invalid line, return as-is
+            return true;
+        }
+        
+        if (plan.counts_alleles()) {
+            const FormatProjection& projection =
+                projection_for(base + tabs[7] + 1, tabs[8] - tabs[7] - 1, scratch);
+            count_site(plan, base, scratch, projection.gt_index);
+            if (!site_passes(plan, scratch)) return false;
+        }
+        
+        if (plan.plink_bed) {
+            return append_bed_record(plan, base, scratch, result);
+        }
+        
+        if (plan.fill_tags || !plan.format_fields.empty()) {
+            rewrite_data_line(plan, base, scratch, out);
+            return true;
+        }
+        
+        // First 9 columns (up to and including FORMAT), then one copy per
+        // run; a run starting at the first sample joins the fixed columns'
+        // copy
+        const std::vector<ColumnRun>& runs = plan.runs;
+        if (!runs.empty() && runs[0].first == 9 && static_cast<size_t>(9 + runs[0].count) <= tabs.size()) {
+            out.append(base, tabs[8 + runs[0].count]);
+            append_runs(base, tabs, runs, 1, out);
+        } else {
+            out.append(base, tabs[8]);
+            append_runs(base, tabs, runs, 0, out);
+        }
+        return true;
+    }
+    
+    // Whether the record's CHROM and POS fall inside --regions
+    bool in_regions(const char* base, size_t len, RecordScratch& scratch) const {
+        const char* tab = static_cast<const char*>(memchr(base, '\t', len));
+        if (!tab) return false;
+        
+        size_t chrom_len = tab - base;
+        if (scratch.region_chrom.size() != chrom_len ||
+            memcmp(scratch.region_chrom.data(), base, chrom_len) != 0) {
+            scratch.region_chrom.assign(base, chrom_len);
+            scratch.region_ranges = regions.find(scratch.region_chrom);
+        }
+        // POS is followed by a tab or the line's newline, which stops strtoll
+        return scratch.region_ranges &&
+               RegionSet::contains(*scratch.region_ranges, std::strtoll(tab + 1, nullptr, 10));
+    }
+    
+    // --min-ac and --exclude-monomorphic on the counts from count_site()
+    static bool site_passes(const SelectionPlan& plan, const RecordScratch& scratch) {
+        const std::vector<int>& counts = scratch.allele_counts;
+        bool pass = scratch.allele_number - counts[0] >= plan.min_ac;
+        if (pass && plan.exclude_monomorphic) {
+            pass = std::count_if(counts.begin(), counts.end(), [](int c) { return c > 0; }) > 1;
+        }
+        return pass;
+    }
+    
+    // Copy one run of sample columns together with the tab before it,
+    // filling columns past the end with '.'
+    static void append_run(const char* base, const std::vector<size_t>& tabs, const ColumnRun& run,
+                           std::string& out) {
+        size_t n_fields = tabs.size();
+        size_t first = run.first;
+        size_t last = std::min<size_t>(first + run.count, n_fields) - 1;
+        if (first < n_fields) {
+            size_t start = tabs[first - 1];
+            out.append(base + start, tabs[last] - start);
+        } else {
+            out += "\t."; // Missing data
+        }
+        for (size_t i = std::max(last + 1, first + 1); i < first + run.count; i++) {
+            out += "\t.";
+        }
+    }
+    
+    // Copy runs[from..], fetching each next run's source while the current
+    // one is copied; on wide lines it is often out of cache
+    static void append_runs(const char* base, const std::vector<size_t>& tabs,
+                            const std::vector<ColumnRun>& runs, size_t from, std::string& out) {
+        size_t n_fields = tabs.size();
+        if (from < runs.size() && static_cast<size_t>(runs[from].first) < n_fields) {
+            prefetch_read(base + tabs[runs[from].first - 1]);
+        }
+        for (size_t r = from; r < runs.size(); r++) {
+            if (r + 1 < runs.size() && static_cast<size_t>(runs[r + 1].first) < n_fields) {
+                prefetch_read(base + tabs[runs[r + 1].first - 1]);
+            }
+            append_run(base, tabs, runs[r], out);
+        }
+    }
+    
+    // Build the projection of one FORMAT string onto --format-fields and find
+    // its GT. Kept keys stay in record order, so GT remains first
+    FormatProjection build_projection(const char* format, size_t len) const {
+        FormatProjection projection;
+        const char* end = format + len;
+        int index = 0;
+        for (const char* key = format; key <= end; index++) {
+            const char* colon = static_cast<const char*>(memchr(key, ':', end - key));
+            const char* key_end = colon ? colon : end;
+            std::string name(key, key_end);
+            if (name == "GT" && projection.gt_index < 0) {
+                projection.gt_index = index;
+            }
+            if (std::find(options.format_fields.begin(), options.format_fields.end(), name) !=
+                options.format_fields.end()) {
+                if (!projection.keep.empty()) projection.format += ':';
+                projection.format += name;
+                projection.keep.push_back(index);
+            }
+            key = key_end + 1;
+        }
+        if (projection.keep.empty()) projection.format = ".";
+        return projection;
+    }
     
-    // Check if file is gzipped
-    bool is_gzipped(const std::string& filename) {
-        std::ifstream file(filename, std::ios::binary);
-        if (!file) return false;
+    // Cached projection for a FORMAT column
+    const FormatProjection& projection_for(const char* format, size_t len, RecordScratch& scratch) const {
+        const std::pair<const std::string, FormatProjection>* last = scratch.last_projection;
+        if (last && last->first.size() == len && memcmp(last->first.data(), format, len) == 0) {
+            return last->second;
+        }
         
-        unsigned char magic[2];
-        file.read(reinterpret_cast<char*>(magic), 2);
-        return (magic[0] == 0x1f && magic[1] == 0x8b);
+        static const size_t MAX_CACHED_FORMATS = 4096;
+        if (scratch.projections.size() >= MAX_CACHED_FORMATS) {
+            scratch.projections.clear();
+            scratch.last_projection = nullptr;
+        }
+        scratch.format_key.assign(format, len);
+        auto it = scratch.projections.find(scratch.format_key);
+        if (it == scratch.projections.end()) {
+            it = scratch.projections.emplace(scratch.format_key, build_projection(format, len)).first;
+        }
+        scratch.last_projection = &*it;
+        return it->second;
     }
     
-    // Load sample names from file
-    void load_samples() {
-        std::ifstream file(sample_file);
-        if (!file) {
-            throw std::runtime_error("Cannot open sample file: " + sample_file);
+    // Copy the projected subfields of one sample value; subfields the record
+    // leaves off the end are written as missing
+    static void project_sample(const char* value, size_t len, const FormatProjection& projection,
+                               std::string& out) {
+        if (projection.keep.empty()) {
+            out += '.';
+            return;
         }
         
-        std::string sample;
-        while (std::getline(file, sample)) {
-            // Remove whitespace
-            sample.erase(std::remove_if(sample.begin(), sample.end(), ::isspace), sample.end());
-            if (!sample.empty()) {
-                target_samples.insert(sample);
+        const char* p = value;
+        const char* end = value + len;
+        bool more = true;
+        int index = 0;
+        for (size_t k = 0; k < projection.keep.size(); k++) {
+            while (more && index < projection.keep[k]) {
+                const char* colon = static_cast<const char*>(memchr(p, ':', end - p));
+                if (colon) {
+                    p = colon + 1;
+                    index++;
+                } else {
+                    more = false;
+                }
+            }
+            if (k > 0) out += ':';
+            if (more) {
+                const char* colon = static_cast<const char*>(memchr(p, ':', end - p));
+                out.append(p, (colon ? colon : end) - p);
+            } else {
+                out += '.';
             }
         }
-        
-        if (target_samples.empty()) {
-            throw std::runtime_error("No samples found in sample file");
+    }
+    
+    // Start of subfield index in a sample value, or nullptr if the value has
+    // fewer subfields
+    static const char* find_subfield(const char* p, const char* end, int index) {
+        for (int i = 0; i < index && p; i++) {
+            p = static_cast<const char*>(memchr(p, ':', end - p));
+            if (p) p++;
         }
-        
-        std::cout << "Loaded " << target_samples.size() << " target samples" << std::endl;
+        return p;
     }
     
-    // Parse header and find sample indices
-    std::string process_header(const std::string& header_line) {
-        std::istringstream iss(header_line);
-        std::string token;
-        std::vector<std::string> fields;
-        
-        while (std::getline(iss, token, '\t')) {
-            fields.push_back(token);
+    // PLINK .bed code of one GT subfield, with ALT as allele 1 and REF as
+    // allele 2: 00 ALT/ALT, 10 REF/ALT, 11 REF/REF, 01 missing. Haploid calls
+    // count as homozygous; anything with a missing allele or more than two
+    // alleles is missing
+    static unsigned bed_genotype(const char* p, const char* end) {
+        static const unsigned MISSING = 1;
+        int alleles = 0;
+        int alts = 0;
+        while (p < end && *p != ':') {
+            if (*p == '0' || *p == '1') {
+                alts += *p - '0';
+                alleles++;
+                p++;
+                if (p < end && *p >= '0' && *p <= '9') return MISSING; // Allele 10+
+            } else if (*p == '/' || *p == '|') {
+                p++;
+            } else {
+                return MISSING;
+            }
+        }
+        if (alleles == 1) return alts ? 0 : 3;
+        if (alleles != 2) return MISSING;
+        static const unsigned DIPLOID[] = {3, 2, 0};
+        return DIPLOID[alts];
+    }
+    
+    // --output-format bed: the record's .bim line goes to output and its
+    // genotypes, four samples per byte with the first in the low bits, to
+    // genotypes. Sites without exactly one ALT allele are dropped
+    bool append_bed_record(const SelectionPlan& plan, const char* base, RecordScratch& scratch,
+                           LineBatch& result) const {
+        const std::vector<size_t>& tabs = scratch.tabs;
+        const char* alt = base + tabs[3] + 1;
+        size_t alt_len = tabs[4] - tabs[3] - 1;
+        if ((alt_len == 1 && alt[0] == '.') || memchr(alt, ',', alt_len)) {
+            scratch.skipped_for_bed = true;
+            return false;
         }
         
-        // Find FORMAT column (should be at index 8)
-        int format_idx = -1;
-        for (int i = 0; i < fields.size(); i++) {
-            if (fields[i] == "FORMAT") {
-                format_idx = i;
-                break;
+        // CHROM, ID, centimorgans, POS, allele 1 (ALT), allele 2 (REF)
+        std::string& out = result.output;
+        out.append(base, tabs[0] + 1);
+        out.append(base + tabs[1] + 1, tabs[2] - tabs[1]);
+        out += "0\t";
+        out.append(base + tabs[0] + 1, tabs[1] - tabs[0]);
+        out.append(alt, alt_len);
+        out += '\t';
+        out.append(base + tabs[2] + 1, tabs[3] - tabs[2] - 1);
+        
+        const FormatProjection& projection =
+            projection_for(base + tabs[7] + 1, tabs[8] - tabs[7] - 1, scratch);
+        size_t n_fields = tabs.size();
+        size_t n_samples = plan.sample_indices.size();
+        std::string& row = result.genotypes;
+        size_t row_start = row.size();
+        row.resize(row_start + (n_samples + 3) / 4, 0);
+        unsigned char* packed = reinterpret_cast<unsigned char*>(&row[row_start]);
+        for (size_t s = 0; s < n_samples; s++) {
+            unsigned code = 1; // Missing
+            size_t idx = plan.sample_indices[s];
+            if (idx < n_fields && projection.gt_index >= 0) {
+                const char* end = base + tabs[idx];
+                const char* gt = find_subfield(base + tabs[idx - 1] + 1, end, projection.gt_index);
+                if (gt) code = bed_genotype(gt, end);
             }
+            packed[s / 4] |= code << (2 * (s % 4));
         }
+        return true;
+    }
+    
+    // Count the alleles called in the selected samples' GT subfields into
+    // counts (index 0 = REF); returns AN, the number of called alleles
+    static int count_alleles(const SelectionPlan& plan, const char* base, const std::vector<size_t>& tabs,
+                             int gt_index, std::vector<int>& counts) {
+        int an = 0;
+        if (gt_index < 0) return an;
         
-        if (format_idx == -1) {
-            throw std::runtime_error("FORMAT column not found in header");
+        size_t n_fields = tabs.size();
+        for (int idx : plan.sample_indices) {
+            if (static_cast<size_t>(idx) >= n_fields) continue;
+            const char* end = base + tabs[idx];
+            const char* p = find_subfield(base + tabs[idx - 1] + 1, end, gt_index);
+            if (!p) continue;
+            
+            // Alleles separated by / or |, up to the end of the subfield
+            while (p < end && *p != ':') {
+                if (*p >= '0' && *p <= '9') {
+                    size_t allele = 0;
+                    while (p < end && *p >= '0' && *p <= '9') allele = allele * 10 + (*p++ - '0');
+                    if (allele < counts.size()) {
+                        counts[allele]++;
+                        an++;
+                    }
+                } else {
+                    p++; // Separator or missing allele
+                }
+            }
         }
+        return an;
+    }
+    
+    // Count the selected genotypes of a record into scratch, one slot per
+    // REF/ALT allele
+    static void count_site(const SelectionPlan& plan, const char* base, RecordScratch& scratch, int gt_index) {
+        const std::vector<size_t>& tabs = scratch.tabs;
+        const char* alt = base + tabs[3] + 1;
+        size_t alt_len = tabs[4] - tabs[3] - 1;
+        size_t n_alts = (alt_len == 1 && alt[0] == '.') ? 0 : std::count(alt, alt + alt_len, ',') + 1;
         
-        // Sample columns start after FORMAT
-        std::vector<std::string> output_fields(fields.begin(), fields.begin() + format_idx + 1);
+        scratch.allele_counts.assign(n_alts + 1, 0);
+        scratch.allele_number = count_alleles(plan, base, tabs, gt_index, scratch.allele_counts);
+    }
+    
+    // Write INFO with AC, AN and AF from count_site(). Existing entries are
+    // replaced in place; missing ones are appended
+    void append_filled_info(const char* base, const RecordScratch& scratch, std::string& out) const {
+        const std::vector<size_t>& tabs = scratch.tabs;
+        const std::vector<int>& counts = scratch.allele_counts;
+        size_t n_alts = counts.size() - 1;
+        int an = scratch.allele_number;
         
-        for (int i = format_idx + 1; i < fields.size(); i++) {
-            if (target_samples.count(fields[i])) {
-                sample_indices.push_back(i);
-                output_fields.push_back(fields[i]);
+        auto append_tag = [&](const std::string& key) {
+            out += key;
+            out += '=';
+            if (key == "AN") {
+                out += std::to_string(an);
+                return;
             }
-        }
+            for (size_t i = 1; i <= n_alts; i++) {
+                if (i > 1) out += ',';
+                if (key == "AC") {
+                    out += std::to_string(counts[i]);
+                } else if (an > 0) {
+                    char value[32];
+                    snprintf(value, sizeof(value), "%g", static_cast<double>(counts[i]) / an);
+                    out += value;
+                } else {
+                    out += '.';
+                }
+            }
+            if (n_alts == 0) out += '.';
+        };
         
-        if (sample_indices.empty()) {
-            throw std::runtime_error("No matching samples found in VCF header");
+        static const char* const TAGS[] = {"AC", "AN", "AF"};
+        bool written[3] = {false, false, false};
+        const char* info = base + tabs[6] + 1;
+        const char* info_end = base + tabs[7];
+        bool first = true;
+        if (!(info_end - info == 1 && info[0] == '.')) {
+            for (const char* entry = info; entry <= info_end;) {
+                const char* semi = static_cast<const char*>(memchr(entry, ';', info_end - entry));
+                const char* entry_end = semi ? semi : info_end;
+                const char* eq = static_cast<const char*>(memchr(entry, '=', entry_end - entry));
+                size_t key_len = (eq ? eq : entry_end) - entry;
+                
+                int tag = -1;
+                for (int t = 0; t < 3; t++) {
+                    if (key_len == 2 && memcmp(entry, TAGS[t], 2) == 0) tag = t;
+                }
+                if (tag < 0 || !written[tag]) {
+                    if (!first) out += ';';
+                    first = false;
+                    if (tag < 0) {
+                        out.append(entry, entry_end - entry);
+                    } else {
+                        append_tag(TAGS[tag]);
+                        written[tag] = true;
+                    }
+                }
+                entry = entry_end + 1;
+            }
+        }
+        for (int t = 0; t < 3; t++) {
+            if (written[t]) continue;
+            if (!first) out += ';';
+            first = false;
+            append_tag(TAGS[t]);
+        }
+    }
+    
+    // Slow path for --fill-tags and --format-fields: INFO is recounted and/or
+    // FORMAT rewritten, and samples are copied one by one when projected
+    void rewrite_data_line(const SelectionPlan& plan, const char* base, RecordScratch& scratch,
+                           std::string& out) const {
+        const std::vector<size_t>& tabs = scratch.tabs;
+        const FormatProjection& projection =
+            projection_for(base + tabs[7] + 1, tabs[8] - tabs[7] - 1, scratch);
+        if (plan.fill_tags) {
+            out.append(base, tabs[6] + 1);
+            append_filled_info(base, scratch, out);
+            out += '\t';
+        } else {
+            out.append(base, tabs[7] + 1);
         }
         
-        std::cout << "Found " << sample_indices.size() << " matching samples out of " 
-                  << (fields.size() - format_idx - 1) << " total samples" << std::endl;
-        
-        // Reconstruct header line
-        std::ostringstream oss;
-        for (int i = 0; i < output_fields.size(); i++) {
-            if (i > 0) oss << "\t";
-            oss << output_fields[i];
+        if (plan.format_fields.empty()) {
+            out.append(base + tabs[7] + 1, tabs[8] - tabs[7] - 1);
+            append_runs(base, tabs, plan.runs, 0, out);
+            return;
         }
         
-        return oss.str();
+        out += projection.format;
+        size_t n_fields = tabs.size();
+        for (int idx : plan.sample_indices) {
+            out += '\t';
+            if (static_cast<size_t>(idx) < n_fields) {
+                size_t start = tabs[idx - 1] + 1;
+                project_sample(base + start, tabs[idx] - start, projection, out);
+            } else {
+                out += '.'; // Missing data
+            }
+        }
     }
     
-    // Process a data line
-    std::string process_data_line(const std::string& line) {
-        std::istringstream iss(line);
-        std::string token;
-        std::vector<std::string> fields;
-        fields.reserve(50); // Reserve space to avoid reallocations
+    // With --format-fields, ##FORMAT lines describing dropped keys are left out
+    bool keep_meta_line(const std::string& line) const {
+        if (options.format_fields.empty() || line.compare(0, 13, "##FORMAT=<ID=") != 0) return true;
+        size_t end = line.find_first_of(",>", 13);
+        std::string id = line.substr(13, end == std::string::npos ? std::string::npos : end - 13);
+        return std::find(options.format_fields.begin(), options.format_fields.end(), id) !=
+               options.format_fields.end();
+    }
+    
+    // Declare AC/AN/AF for --fill-tags unless the input header already does
+    static void add_fill_tags_header(std::string& header) {
+        static const char* const DEFINITIONS[][2] = {
+            {"AC", "##INFO=<ID=AC,Number=A,Type=Integer,Description=\"Allele count in genotypes\">"},
+            {"AN", "##INFO=<ID=AN,Number=1,Type=Integer,Description=\"Total number of alleles in called genotypes\">"},
+            {"AF", "##INFO=<ID=AF,Number=A,Type=Float,Description=\"Allele frequency\">"},
+        };
+        for (const auto& definition : DEFINITIONS) {
+            std::string prefix = std::string("##INFO=<ID=") + definition[0] + ",";
+            if (header.compare(0, prefix.size(), prefix) != 0 &&
+                header.find("\n" + prefix) == std::string::npos) {
+                header += definition[1];
+                header += "\n";
+            }
+        }
+    }
+    
+    // Open the input and consume meta lines up to and including #CHROM
+    void read_header() {
+        BgzfLineReader* bgzf_input = nullptr;
+        std::unique_ptr<InputSource> source(new InputSource(options.input_file));
+        bool bcf = is_bcf(source->peek());
+        bool bgzf = is_bgzf(source->peek());
+        int codec_threads = (bgzf ? options.inflate_threads : 0) +
+                            (options.compress_output ? options.deflate_threads : 0);
+        if (options.thread_budget) codec_threads = std::min(codec_threads, options.thread_budget);
+        codec_pool.reset(new TaskPool(codec_threads, &codec_gate));
         
-        while (std::getline(iss, token, '\t')) {
-            fields.push_back(std::move(token));
+        if (bgzf) {
+            std::cout << "Detected BGZF input, inflating with " << options.inflate_threads << " threads" << std::endl;
+            bgzf_input = new BgzfLineReader(std::move(source), options.inflate_threads, codec_pool.get());
+            inflating = true;
+            input.reset(bgzf_input);
+            if (bcf) bcf_input = bgzf_input;
+        } else if (is_gzipped(source->peek())) {
+            GzLineReader* gz_input = new GzLineReader(std::move(source));
+            input.reset(gz_input);
+            if (bcf) bcf_input = gz_input;
+        } else if (bcf) {
+            bcf_input = new PlainLineReader(std::move(source));
+            input.reset(bcf_input);
+        } else if ((options.use_mmap || options.split_input) && !source->is_stdin()) {
+#ifdef VSF_HAVE_MMAP
+            source.reset();
+            mapped_input = new MmapLineReader(options.input_file);
+            input.reset(mapped_input);
+#else
+            throw std::runtime_error("--mmap is not supported on this platform");
+#endif
+        } else {
+            input.reset(new PlainLineReader(std::move(source)));
+        }
+        if (bcf_input) {
+            read_bcf_header();
+            return;
         }
         
-        if (fields.size() < 9) {
-            return line; // Invalid line, return as-is
+        std::string line;
+        std::string meta;
+        while (input->next_line(line)) {
+            lines_processed++;
+            if (line.compare(0, 6, "#CHROM") == 0) {
+                if (options.fill_tags) add_fill_tags_header(meta);
+                for (auto& cohort : cohorts) {
+                    cohort->plan.header = meta;
+                    process_header(*cohort, line);
+                    scan_columns = std::max(scan_columns, cohort->plan.last_column);
+                }
+                // A resumed run continues from one position, so --checkpoint scans
+                if (bgzf_input && !regions.empty() && options.checkpoint_file.empty()) {
+                    seek_to_regions(*bgzf_input);
+                }
+                return;
+            }
+            if (!keep_meta_line(line)) continue;
+            meta += line;
+            meta += "\n";
         }
         
-        // Build output line efficiently
-        std::ostringstream oss;
-        // First 9 columns (up to and including FORMAT)
-        for (int i = 0; i < 9; i++) {
-            if (i > 0) oss << "\t";
-            oss << fields[i];
+        throw std::runtime_error("No #CHROM header line found in " + options.input_file);
+    }
+    
+    // BCF input: the header text holds the same meta and #CHROM lines as VCF.
+    // Meta lines are kept in order, so the implicit dictionary numbering the
+    // records refer to is unchanged; each cohort's header is re-encoded as BCF
+    void read_bcf_header() {
+        const char* unsupported = !options.format_fields.empty() ? "--format-fields"
+                                : options.fill_tags ? "--fill-tags"
+                                : options.min_ac > 0 ? "--min-ac"
+                                : options.exclude_monomorphic ? "--exclude-monomorphic"
+                                : !options.regions.empty() ? "--regions"
+                                : !options.index_format.empty() ? "--index"
+                                : options.output_format != "vcf" ? "--output-format"
+                                : nullptr;
+        if (unsupported) {
+            throw std::runtime_error(std::string(unsupported) + " is not supported for BCF input");
         }
         
-        // Add selected sample columns
-        for (int idx : sample_indices) {
-            oss << "\t";
-            if (idx < fields.size()) {
-                oss << fields[idx];
-            } else {
-                oss << "."; // Missing data
+        unsigned char fixed[sizeof(BCF_MAGIC) + 4];
+        if (!bcf_input->read_exact(reinterpret_cast<char*>(fixed), sizeof(fixed)) ||
+            memcmp(fixed, BCF_MAGIC, sizeof(BCF_MAGIC)) != 0) {
+            throw std::runtime_error("Unsupported BCF version in " + options.input_file + " (need BCF 2.2)");
+        }
+        std::string text(le32(fixed + sizeof(BCF_MAGIC)), '\0');
+        if (!bcf_input->read_exact(&text[0], text.size())) {
+            throw std::runtime_error("Truncated BCF header in " + options.input_file);
+        }
+        text.resize(strnlen(text.data(), text.size()));
+        std::cout << "Detected BCF input; samples are copied without parsing" << std::endl;
+        
+        std::string meta;
+        std::istringstream lines(text);
+        std::string line;
+        while (std::getline(lines, line)) {
+            lines_processed++;
+            if (line.compare(0, 6, "#CHROM") == 0) {
+                for (auto& cohort : cohorts) {
+                    cohort->plan.header = meta;
+                    process_header(*cohort, line);
+                }
+                for (auto& cohort : cohorts) {
+                    std::string& header = cohort->plan.header;
+                    unsigned char length[4];
+                    put_le32(length, static_cast<uint32_t>(header.size() + 1));
+                    header.insert(0, reinterpret_cast<const char*>(length), sizeof(length));
+                    header.insert(0, BCF_MAGIC, sizeof(BCF_MAGIC));
+                    header += '\0';
+                }
+                return;
             }
+            meta += line;
+            meta += "\n";
         }
         
-        return oss.str();
+        throw std::runtime_error("No #CHROM header line found in " + options.input_file);
+    }
+    
+    // Append whole BCF records until about max bytes (at least one record);
+    // false once the input is exhausted
+    bool read_bcf_records(std::string& out, size_t max) {
+        size_t start = out.size();
+        unsigned char lengths[8];
+        while (out.size() - start < max && bcf_input->read_exact(reinterpret_cast<char*>(lengths), sizeof(lengths))) {
+            uint32_t l_shared = le32(lengths);
+            uint32_t l_indiv = le32(lengths + 4);
+            if (l_shared > BCF_MAX_PART || l_indiv > BCF_MAX_PART) {
+                throw std::runtime_error("Truncated BCF record in " + options.input_file);
+            }
+            size_t size = sizeof(lengths) + static_cast<size_t>(l_shared) + l_indiv;
+            size_t at = out.size();
+            out.resize(at + size);
+            memcpy(&out[at], lengths, sizeof(lengths));
+            if (!bcf_input->read_exact(&out[at + sizeof(lengths)], size - sizeof(lengths))) {
+                throw std::runtime_error("Truncated BCF record in " + options.input_file);
+            }
+        }
+        return out.size() > start;
+    }
+    
+    // With --regions on indexed BGZF input, read only the index chunks that
+    // can hold matching records instead of inflating the whole file
+    void seek_to_regions(BgzfLineReader& reader) {
+        if (is_stdio(options.input_file)) return;
+        for (const char* suffix : {".tbi", ".csi"}) {
+            std::string index_file = options.input_file + suffix;
+            if (!std::ifstream(index_file)) continue;
+            
+            std::vector<VirtualSpan> spans = IndexReader(index_file).find_spans(regions);
+            reader.restrict_to(spans);
+            std::cout << "Using index " << index_file << ": reading " << spans.size()
+                      << " chunks" << std::endl;
+            return;
+        }
     }
     
-    // Reader thread - reads from file and feeds work queue
+    // Reader thread - reads data lines and feeds work queue
     void reader_thread() {
         try {
-            if (is_gzipped(input_file)) {
-                read_gz_stream();
-            } else {
-                read_regular_stream();
+            LineBatch batch;
+#ifdef VSF_HAVE_MMAP
+            if (mapped_input) {
+                while (!failed && mapped_input->next_range(batch_bytes, batch.text, batch.text_size)) {
+                    batch.bytes = batch.text_size;
+                    if (checkpoint) batch.input_end = mapped_input->tell();
+                    flush_batch(batch);
+                }
+            }
+#endif
+            while (!failed) {
+                batch.input = input_buffers.take();
+                if (batch.input.capacity() < batch_bytes) {
+                    batch.input.reserve(batch_bytes);
+                }
+                if (bcf_input ? !read_bcf_records(batch.input, batch_bytes)
+                              : !input->read_lines(batch.input, batch_bytes)) break;
+                batch.bytes = batch.input.size();
+                if (checkpoint) batch.input_end = input->tell();
+                flush_batch(batch);
             }
         } catch (const std::exception& e) {
             std::cerr << "Reader error: " << e.what() << std::endl;
+            failed = true;
         }
         
-        finished_reading = true;
-        input_cv.notify_all();
+        input_queue.close();
     }
     
-    void read_gz_stream() {
-        gzFile file = gzopen(input_file.c_str(), "rb");
-        if (!file) {
-            throw std::runtime_error("Cannot open gzipped file: " + input_file);
+    // Number the batch and push it to the work queue (wait if queue is full or
+    // the memory budget is spent)
+    void flush_batch(LineBatch& batch) {
+        if (batch.input.empty() && !batch.text) return;
+        batch.seq = batches_read++;
+        batch.charged = batch.bytes;
+        stats.input_bytes += batch.bytes;
+        stats.batches++;
+        {
+            WaitTimer wait(stats.reader_budget_ns);
+            memory_budget.acquire(batch.charged);
+        }
+        {
+            WaitTimer wait(stats.reader_queue_ns);
+            input_queue.push(std::move(batch));
+        }
+        batch = LineBatch();
+    }
+    
+    // Filter one line into each cohort's result; stray comment lines pass
+    // through to VCF output
+    void process_line(const char* line, size_t len, RecordScratch& scratch,
+                      const std::vector<LineBatch*>& results) const {
+        if (len > 0 && line[0] != '#') {
+            if (!scan_record(line, len, scratch)) {
+                for (size_t& dropped : scratch.sites_dropped) dropped++;
+                return;
+            }
+            for (size_t c = 0; c < cohorts.size(); c++) {
+                if (process_data_line(cohorts[c]->plan, line, len, scratch, *results[c])) {
+                    results[c]->output += '\n';
+                } else if (scratch.skipped_for_bed) {
+                    scratch.bed_skipped[c]++;
+                } else {
+                    scratch.sites_dropped[c]++;
+                }
+            }
+        } else {
+            for (size_t c = 0; c < cohorts.size(); c++) {
+                if (cohorts[c]->plan.plink_bed) continue;
+                results[c]->output.append(line, len);
+                results[c]->output += '\n';
+            }
+        }
+    }
+    
+    // Filter every line of a batch into one result per cohort; returns the
+    // line count
+    size_t process_batch(const LineBatch& batch, RecordScratch& scratch,
+                         const std::vector<LineBatch*>& results) const {
+        const char* text = batch.text;
+        size_t size = batch.text_size;
+        if (!batch.input.empty()) {
+            text = batch.input.data();
+            size = batch.input.size();
+        }
+        scratch.sites_dropped.resize(cohorts.size());
+        scratch.bed_skipped.resize(cohorts.size());
+        for (LineBatch* result : results) {
+            std::string& out = result->output;
+            if (out.capacity() < size / results.size()) out.reserve(size / results.size());
+        }
+        
+        std::vector<size_t>& newlines = scratch.newlines;
+        newlines.clear();
+        delimiter_kernel.find_all(text, size, '\n', 0, newlines, SIZE_MAX);
+        if (newlines.empty() || newlines.back() + 1 != size) {
+            newlines.push_back(size); // Last line without newline
+        }
+        
+        size_t start = 0;
+        for (size_t end : newlines) {
+            process_line(text + start, end - start, scratch, results);
+            start = end + 1;
         }
+        return newlines.size();
+    }
+    
+    // Subset one BCF record for a cohort. The site part is copied whole with
+    // its sample count patched; each FORMAT field keeps its key and type and
+    // its per-sample array is cut with one memcpy per copy run
+    static void process_bcf_record(const SelectionPlan& plan, const unsigned char* record, std::string& out) {
+        size_t l_shared = le32(record);
+        size_t l_indiv = le32(record + 4);
+        const unsigned char* shared = record + 8;
+        if (l_shared < BCF_SHARED_N_SAMPLE + 4) throw std::runtime_error("Malformed BCF record");
+        uint32_t n_fmt_sample = le32(shared + BCF_SHARED_N_SAMPLE);
+        size_t n_samples = n_fmt_sample & 0xffffff;
+        size_t n_fmt = n_fmt_sample >> 24;
+        
+        size_t out_start = out.size();
+        out.append(reinterpret_cast<const char*>(record), 8 + l_shared);
+        unsigned char* out_record = reinterpret_cast<unsigned char*>(&out[out_start]);
+        put_le32(out_record + 8 + BCF_SHARED_N_SAMPLE,
+                 static_cast<uint32_t>(n_fmt << 24 | plan.sample_indices.size()));
         
-        char buffer[65536];
-        while (gzgets(file, buffer, sizeof(buffer))) {
-            std::string line(buffer);
-            if (!line.empty() && line.back() == '\n') {
-                line.pop_back();
+        // Sample s is VCF column s + 9
+        const unsigned char* p = shared + l_shared;
+        const unsigned char* end = p + l_indiv;
+        for (size_t f = 0; f < n_fmt; f++) {
+            const unsigned char* field = p;
+            bcf_typed_int(p, end); // Dictionary key
+            if (p >= end) throw std::runtime_error("Truncated BCF record");
+            unsigned type = *p & 0x0f;
+            int64_t count = *p++ >> 4;
+            if (count == 15) count = bcf_typed_int(p, end);
+            size_t stride = static_cast<size_t>(count) * bcf_type_size(type);
+            if (count < 0 || static_cast<size_t>(end - p) < stride * n_samples) {
+                throw std::runtime_error("Truncated BCF record");
             }
-            
-            // Wait if queue is full
-            std::unique_lock<std::mutex> lock(input_mutex);
-            input_cv.wait(lock, [this] { return input_queue.size() < MAX_QUEUE_SIZE; });
-            
-            input_queue.push(std::move(line));
-            lock.unlock();
-            input_cv.notify_one();
+            out.append(reinterpret_cast<const char*>(field), p - field);
+            for (size_t r = 0; r < plan.runs.size(); r++) {
+                const ColumnRun& run = plan.runs[r];
+                size_t first = run.first - 9;
+                if (first + run.count > n_samples) throw std::runtime_error("BCF record has fewer samples than its header");
+                if (r + 1 < plan.runs.size()) prefetch_read(p + (plan.runs[r + 1].first - 9) * stride);
+                out.append(reinterpret_cast<const char*>(p + first * stride), run.count * stride);
+            }
+            p += stride * n_samples;
         }
         
-        gzclose(file);
+        out_record = reinterpret_cast<unsigned char*>(&out[out_start]);
+        put_le32(out_record + 4, static_cast<uint32_t>(out.size() - out_start - 8 - l_shared));
     }
     
-    void read_regular_stream() {
-        std::ifstream file(input_file);
-        if (!file) {
-            throw std::runtime_error("Cannot open file: " + input_file);
+    // Subset every BCF record of a batch into one result per cohort; returns
+    // the record count
+    size_t process_bcf_batch(const LineBatch& batch, const std::vector<LineBatch*>& results) const {
+        const unsigned char* text = reinterpret_cast<const unsigned char*>(batch.input.data());
+        size_t size = batch.input.size();
+        for (LineBatch* result : results) {
+            std::string& out = result->output;
+            if (out.capacity() < size / results.size()) out.reserve(size / results.size());
         }
         
-        std::string line;
-        while (std::getline(file, line)) {
-            // Wait if queue is full
-            std::unique_lock<std::mutex> lock(input_mutex);
-            input_cv.wait(lock, [this] { return input_queue.size() < MAX_QUEUE_SIZE; });
-            
-            input_queue.push(std::move(line));
-            lock.unlock();
-            input_cv.notify_one();
+        size_t count = 0;
+        for (size_t pos = 0; pos < size; count++) {
+            for (size_t c = 0; c < cohorts.size(); c++) {
+                process_bcf_record(cohorts[c]->plan, text + pos, results[c]->output);
+            }
+            pos += 8 + static_cast<size_t>(le32(text + pos)) + le32(text + pos + 4);
+        }
+        return count;
+    }
+    
+    // Add the sites a thread dropped or skipped to each cohort's totals (BCF
+    // batches drop none)
+    void collect_dropped(RecordScratch& scratch) {
+        for (size_t c = 0; c < scratch.sites_dropped.size(); c++) {
+            cohorts[c]->sites_dropped += scratch.sites_dropped[c];
+            cohorts[c]->bed_skipped += scratch.bed_skipped[c];
+            scratch.sites_dropped[c] = 0;
+            scratch.bed_skipped[c] = 0;
         }
     }
     
     // Worker thread function
     void worker_thread() {
+        RecordScratch scratch;
+        LineBatch batch;
+        std::vector<LineBatch> results(cohorts.size());
+        std::vector<LineBatch*> pointers(cohorts.size());
         while (true) {
-            std::unique_lock<std::mutex> lock(input_mutex);
-            input_cv.wait(lock, [this] { return !input_queue.empty() || finished_reading; });
+            // A permit covers waiting for input too, so only permitted
+            // workers count as starved
+            worker_gate.enter();
+            {
+                WaitTimer wait(stats.worker_input_ns);
+                if (!input_queue.pop(batch)) {
+                    worker_gate.leave();
+                    break;
+                }
+            }
+            stats.add_queue_depth(input_queue.size());
+            for (size_t c = 0; c < cohorts.size(); c++) {
+                results[c].seq = batch.seq;
+                results[c].output = output_buffers.take();
+                if (cohorts[c]->plan.plink_bed) results[c].genotypes = output_buffers.take();
+                pointers[c] = &results[c];
+            }
+            size_t count = 0;
+            if (!failed) {
+                try {
+                    count = bcf_input ? process_bcf_batch(batch, pointers)
+                                      : process_batch(batch, scratch, pointers);
+                } catch (const std::exception& e) {
+                    std::cerr << "Worker error: " << e.what() << std::endl;
+                    failed = true;
+                }
+            }
+            if (failed) {
+                // Pass empty batches on so the writers keep their order and
+                // the pipeline drains
+                count = 0;
+                for (LineBatch& result : results) {
+                    result.output.clear();
+                    result.genotypes.clear();
+                }
+            }
             
-            if (input_queue.empty() && finished_reading) {
-                break;
+            // The input lines are no longer needed; only the outputs stay queued
+            input_buffers.give(std::move(batch.input));
+            batch.text = nullptr;
+            size_t output_bytes = 0;
+            for (LineBatch& result : results) {
+                result.charged = result.output.size() + result.genotypes.size();
+                result.input_end = batch.input_end;
+                result.lines = count;
+                output_bytes += result.charged;
+            }
+            memory_budget.resize(batch.charged, output_bytes);
+            worker_gate.leave();
+            
+            // Hand to the writers; batches too far ahead of a writer wait so
+            // its reorder window stays bounded
+            {
+                WaitTimer wait(stats.worker_window_ns);
+                for (size_t c = 0; c < cohorts.size(); c++) {
+                    cohorts[c]->output_batches.push(batch.seq, std::move(results[c]));
+                }
+            }
+            collect_dropped(scratch);
+            lines_processed += count;
+            stats.records += count;
+        }
+    }
+    
+    // -t auto: the first split of the budget. Decompression and compression
+    // each bring a quarter to the codec pool when the run has them; parsing
+    // gets the rest
+    void plan_threads() {
+        int budget = options.thread_budget;
+        int codecs = inflating + options.compress_output;
+        codec_permits = codecs ? std::max(1, codecs * budget / 4) : 0;
+        worker_permits = std::max(1, budget - codec_permits);
+        apply_permits();
+    }
+    
+    void apply_permits() {
+        codec_gate.set_limit(std::max(1, codec_permits));
+        worker_gate.set_limit(worker_permits);
+        if (options.stats) {
+            std::cerr << "[stats] threads: codec " << codec_permits << ", parse " << worker_permits << std::endl;
+        }
+    }
+    
+    // -t auto: move one permit toward the stage holding the others up, judged
+    // by where the waits of the last interval went. Workers blocked on the
+    // reorder window wait for compression, and idle workers with the reader
+    // not blocked wait for decompression; both want the codec pool. A reader
+    // blocked on a full queue waits for the workers
+    void rebalance(const uint64_t (&waited)[3], double interval) {
+        double blocked_on_writers = waited[0] / 1e9 / interval;
+        double starved = waited[1] / 1e9 / interval;
+        double reader_blocked = waited[2] / 1e9 / interval;
+        bool codec_bound = (options.compress_output && blocked_on_writers > 0.5) ||
+                           (inflating && starved > 0.5 && reader_blocked < 0.1);
+        
+        if (codec_permits > 0 && codec_bound && worker_permits > 1) {
+            worker_permits--;
+            codec_permits++;
+        } else if (reader_blocked > 0.5 && codec_permits > 1 && blocked_on_writers < 0.1) {
+            codec_permits--;
+            worker_permits++;
+        } else {
+            return;
+        }
+        apply_permits();
+    }
+    
+    // Until the pipeline finishes: once a second the line count on stdout, or
+    // with --stats the input, record and output rates on stderr. With -t auto
+    // it also rebalances the stages four times a second
+    void monitor_thread() {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t last_bytes = 0;
+        size_t last_records = 0;
+        int ticks_per_report = options.thread_budget ? 4 : 1;
+        uint64_t last_waits[3] = {0, 0, 0};
+        std::unique_lock<std::mutex> lock(monitor_mutex);
+        for (int tick = 1;
+             !monitor_cv.wait_for(lock, std::chrono::milliseconds(1000 / ticks_per_report),
+                                  [this] { return monitor_done; });
+             tick++) {
+            if (options.thread_budget) {
+                uint64_t waits[3] = {stats.worker_window_ns, stats.worker_input_ns, stats.reader_queue_ns};
+                uint64_t waited[3];
+                for (int i = 0; i < 3; i++) {
+                    waited[i] = waits[i] - last_waits[i];
+                    last_waits[i] = waits[i];
+                }
+                rebalance(waited, 1.0 / ticks_per_report);
             }
+            if (tick % ticks_per_report != 0) continue;
             
-            if (input_queue.empty()) {
+            if (!options.stats) {
+                std::cout << "Processed " << lines_processed << " lines\r" << std::flush;
                 continue;
             }
             
-            std::string line = std::move(input_queue.front());
-            input_queue.pop();
-            lock.unlock();
-            input_cv.notify_one();
+            size_t records = stats.records;
+            
+            uint64_t bytes = stats.input_bytes;
+            uint64_t written = 0;
+            for (const auto& cohort : cohorts) written += cohort->bytes_written;
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            char line[256];
+            snprintf(line, sizeof(line),
+                     "[stats] %.0fs: read %.1f MB (%.1f MB/s), %zu records (%zu/s), wrote %.1f MB, "
+                     "input queue %zu/%zu, %.1f MB in flight\n",
+                     elapsed, bytes / 1048576.0, (bytes - last_bytes) / 1048576.0, records, records - last_records,
+                     written / 1048576.0, input_queue.size(), MAX_QUEUE_SIZE,
+                     memory_budget.in_use() / 1048576.0);
+            std::cerr << line;
+            last_bytes = bytes;
+            last_records = records;
+        }
+    }
+    
+    // --stats summary as JSON on stderr
+    void report_stats(double seconds) const {
+        auto to_seconds = [](uint64_t ns) { return ns / 1e9; };
+        char text[512];
+        std::ostringstream out;
+        snprintf(text, sizeof(text),
+                 "{\n  \"seconds\": %.3f,\n"
+                 "  \"input\": {\"bytes\": %llu, \"records\": %llu, \"batches\": %llu, \"mb_per_s\": %.1f},\n",
+                 seconds, static_cast<unsigned long long>(stats.input_bytes.load()),
+                 static_cast<unsigned long long>(stats.records.load()),
+                 static_cast<unsigned long long>(stats.batches.load()),
+                 stats.input_bytes / 1048576.0 / std::max(seconds, 1e-9));
+        out << text;
+        if (options.thread_budget) {
+            out << "  \"threads\": {\"budget\": " << options.thread_budget << ", \"codec\": " << codec_permits
+                << ", \"parse\": " << worker_permits << "},\n";
+        }
+        out << "  \"outputs\": [";
+        for (size_t c = 0; c < cohorts.size(); c++) {
+            snprintf(text, sizeof(text), "%s\n    {\"file\": \"%s\", \"bytes\": %llu, \"sites_dropped\": %zu}",
+                     c ? "," : "", cohorts[c]->output_file.c_str(),
+                     static_cast<unsigned long long>(cohorts[c]->bytes_written.load()), cohorts[c]->sites_dropped.load());
+            out << text;
+        }
+        snprintf(text, sizeof(text),
+                 "\n  ],\n  \"wait_seconds\": {\"reader_on_input_queue\": %.3f, \"reader_on_memory_budget\": %.3f, "
+                 "\"workers_on_input\": %.3f, \"workers_on_reorder_window\": %.3f, \"writers_on_next_batch\": %.3f},\n",
+                 to_seconds(stats.reader_queue_ns), to_seconds(stats.reader_budget_ns),
+                 to_seconds(stats.worker_input_ns), to_seconds(stats.worker_window_ns),
+                 to_seconds(stats.writer_wait_ns));
+        out << text << "  \"input_queue_depth\": {";
+        for (int b = 0; b < PipelineStats::DEPTH_BUCKETS; b++) {
+            size_t low = b == 0 ? 0 : size_t(1) << (b - 1);
+            size_t high = (size_t(1) << b) - 1;
+            std::string label = b + 1 == PipelineStats::DEPTH_BUCKETS ? std::to_string(low) + "+"
+                              : low == high ? std::to_string(low)
+                                            : std::to_string(low) + "-" + std::to_string(high);
+            out << (b ? ", " : "") << "\"" << label << "\": " << stats.queue_depth[b].load();
+        }
+        out << "}\n}\n";
+        std::cerr << out.str();
+    }
+    
+    // Return a written batch's bytes to the budget and its buffer to the pool
+    void recycle_output(LineBatch& batch) {
+        memory_budget.release(batch.charged);
+        batch.charged = 0;
+        output_buffers.give(std::move(batch.output));
+        output_buffers.give(std::move(batch.genotypes));
+    }
+    
+    // Wait for the next batch in input order, recycling the previous one held
+    // in batch; false once everything is written
+    bool next_output_batch(Cohort& cohort, LineBatch& batch) {
+        recycle_output(batch);
+        WaitTimer wait(stats.writer_wait_ns);
+        if (!cohort.output_batches.pop(batch)) return false;
+        cohort.bytes_written += batch.output.size() + batch.genotypes.size();
+        cohort.lines_written += batch.lines;
+        return true;
+    }
+    
+    // --checkpoint: continue from an earlier run's checkpoint if there is one
+    void open_checkpoint() {
+        std::vector<std::string> outputs;
+        for (const auto& cohort : cohorts) outputs.push_back(cohort->output_file);
+        checkpoint.reset(new Checkpoint(options.checkpoint_file, options.input_file, outputs));
+        input->tell();  // Throws for input a rerun could not seek back into
+        if (!checkpoint->load(resume)) return;
+        
+        resuming = true;
+        input->seek(resume.input_position);
+        lines_processed += resume.lines;  // Header lines are already counted
+        for (auto& cohort : cohorts) cohort->lines_written = resume.lines;
+        std::cout << "Resuming from checkpoint " << options.checkpoint_file << " after " << resume.lines
+                  << " lines" << std::endl;
+    }
+    
+    size_t cohort_index(const Cohort& cohort) const {
+        size_t c = 0;
+        while (cohorts[c].get() != &cohort) c++;
+        return c;
+    }
+    
+    // Cut a resumed output back to the length its checkpoint recorded;
+    // returns that length
+    uint64_t resume_output(const Cohort& cohort) {
+        uint64_t size = resume.output_sizes[cohort_index(cohort)];
+        std::ifstream existing(cohort.output_file, std::ios::binary | std::ios::ate);
+        if (!existing || static_cast<uint64_t>(existing.tellg()) < size || !truncate_file(cohort.output_file, size)) {
+            throw std::runtime_error("Cannot resume " + cohort.output_file +
+                                     ": it is missing or shorter than its checkpoint");
+        }
+        return size;
+    }
+    
+    bool checkpoint_due(const LineBatch& batch) const {
+        return checkpoint && (batch.seq + 1) % CHECKPOINT_BATCHES == 0;
+    }
+    
+    // Batch has gone into cohort's output, whose first size bytes now hold
+    // everything through it, lines input lines in all: sync the file and
+    // report to the checkpoint
+    void commit_checkpoint(Cohort& cohort, const LineBatch& batch, uint64_t size, uint64_t lines) {
+        if (failed) return;  // Batches after a failure may be missing from the output
+        if (!sync_file(cohort.output_file)) {
+            throw std::runtime_error("Cannot sync output file: " + cohort.output_file);
+        }
+        checkpoint->commit(batch.seq, cohort_index(cohort), batch.input_end, lines, size);
+    }
+    
+    // Writer thread - writes a cohort's output as it becomes available
+    void writer_thread(Cohort& cohort) {
+        try {
+            if (cohort.plan.plink_bed) {
+                write_bed_stream(cohort);
+            } else if (options.compress_output) {
+                write_gz_stream(cohort);
+            } else {
+                write_regular_stream(cohort);
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Writer error on " << cohort.output_file << ": " << e.what() << std::endl;
+            failed = true;
+            
+            // Keep draining so workers waiting on the reorder window can finish;
+            // batches lost with the exception never return their bytes
+            memory_budget.set_limit(0);
+            LineBatch batch;
+            while (next_output_batch(cohort, batch)) {}
+        }
+    }
+    
+    // -z output is BGZF so it can be indexed and inflated in parallel downstream
+    void write_gz_stream(Cohort& cohort) {
+        // Each cohort keeps its share of the deflate threads' jobs in flight;
+        // the threads themselves are the codec pool's, stolen by whichever
+        // cohort has blocks waiting
+        int threads = std::max(1, options.deflate_threads / static_cast<int>(cohorts.size()));
+        if (resuming) resume_output(cohort);
+        BgzfWriter out_file(cohort.output_file, threads, Z_DEFAULT_COMPRESSION, codec_pool.get(), resuming);
+        const SelectionPlan& plan = cohort.plan;
+        std::unique_ptr<IndexBuilder> index;
+        if (!options.index_format.empty()) {
+            index.reset(new IndexBuilder(options.index_format == "csi"));
+        }
+        
+        if (!resuming) out_file.write(plan.header.data(), plan.header.size());
+        
+        LineBatch batch;
+        while (next_output_batch(cohort, batch)) {
+            if (index) {
+                const char* text = batch.output.data();
+                uint64_t base = out_file.tell();
+                for (size_t start = 0; start < batch.output.size();) {
+                    size_t end = static_cast<const char*>(
+                        memchr(text + start, '\n', batch.output.size() - start)) - text;
+                    if (end > start && text[start] != '#') {
+                        index->add_line(text + start, end - start, base + start, base + end + 1);
+                    }
+                    start = end + 1;
+                }
+            }
+            out_file.write(batch.output.data(), batch.output.size());
+            if (checkpoint_due(batch)) commit_checkpoint(cohort, batch, out_file.flush(), cohort.lines_written);
+        }
+        
+        out_file.close();
+        if (index) {
+            std::string index_file = cohort.output_file + "." + options.index_format;
+            index->write(index_file, out_file);
+            std::cout << "Wrote index " << index_file << std::endl;
+        }
+    }
+    
+    // Output path without a trailing .bed, the prefix PLINK expects
+    static std::string plink_prefix(const std::string& output_file) {
+        size_t n = output_file.size();
+        return n > 4 && output_file.compare(n - 4, 4, ".bed") == 0 ? output_file.substr(0, n - 4) : output_file;
+    }
+    
+    // --output-format bed: PLINK 1 variant-major .bed with .bim and .fam
+    // sidecars next to it. Rows arrive packed from the workers, so the writer
+    // only appends them and the sites' .bim lines
+    void write_bed_stream(Cohort& cohort) {
+        std::string prefix = plink_prefix(cohort.output_file);
+        std::ofstream fam(prefix + ".fam");
+        std::ofstream bim(prefix + ".bim", std::ios::binary);
+        std::ofstream bed(prefix + ".bed", std::ios::binary);
+        if (!fam || !bim || !bed) {
+            throw std::runtime_error("Cannot create output files " + prefix + ".bed/.bim/.fam");
+        }
+        
+        // Family and individual ID are both the VCF sample name
+        for (const std::string& sample : cohort.plan.sample_names) {
+            fam << sample << ' ' << sample << " 0 0 0 -9\n";
+        }
+        static const char BED_MAGIC[] = {0x6c, 0x1b, 0x01}; // Variant-major
+        bed.write(BED_MAGIC, sizeof(BED_MAGIC));
+        
+        size_t sites = 0;
+        size_t row_bytes = (cohort.plan.sample_names.size() + 3) / 4;
+        LineBatch batch;
+        while (next_output_batch(cohort, batch)) {
+            bim.write(batch.output.data(), batch.output.size());
+            bed.write(batch.genotypes.data(), batch.genotypes.size());
+            sites += batch.genotypes.size() / row_bytes;
+        }
+        
+        fam.close();
+        bim.close();
+        bed.close();
+        if (!fam || !bim || !bed) {
+            throw std::runtime_error("Write error on output files " + prefix + ".bed/.bim/.fam");
+        }
+        std::cout << "Wrote " << sites << " biallelic sites to " << prefix << ".bed" << std::endl;
+    }
+    
+#ifdef VSF_HAVE_WRITEV
+    // Write every buffer in iov, resuming after partial writes
+    static void write_all(int fd, std::vector<iovec>& iov) {
+        size_t first = 0;
+        while (first < iov.size()) {
+            ssize_t n = writev(fd, iov.data() + first, static_cast<int>(iov.size() - first));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("Write error on output file: ") + strerror(errno));
+            }
+            size_t left = n;
+            while (first < iov.size() && left >= iov[first].iov_len) {
+                left -= iov[first++].iov_len;
+            }
+            if (left > 0) {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + left;
+                iov[first].iov_len -= left;
+            }
+        }
+    }
+    
+    // Uncompressed output: every finished batch already waiting in order is
+    // gathered into one writev, so the writer makes one syscall per group of
+    // batches and never copies or formats lines
+    void write_regular_stream(Cohort& cohort) {
+        static const size_t MAX_WRITE_BATCHES = 16;
+        bool to_stdout = is_stdio(cohort.output_file);
+        uint64_t size = resuming ? resume_output(cohort) : 0;
+        int flags = resuming ? O_WRONLY | O_APPEND : O_WRONLY | O_CREAT | O_TRUNC;
+        int fd = to_stdout ? STDOUT_FILENO : open(cohort.output_file.c_str(), flags, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot create output file: " + cohort.output_file);
+        }
+        
+        try {
+            std::vector<iovec> iov;
+            if (!resuming) {
+                iov.push_back({const_cast<char*>(cohort.plan.header.data()), cohort.plan.header.size()});
+                write_all(fd, iov);
+                size = cohort.plan.header.size();
+            }
+            
+            std::vector<LineBatch> ready(MAX_WRITE_BATCHES);
+            while (next_output_batch(cohort, ready[0])) {
+                size_t count = 1;
+                while (count < ready.size() && cohort.output_batches.try_pop(ready[count])) {
+                    cohort.bytes_written += ready[count].output.size();
+                    cohort.lines_written += ready[count++].lines;
+                }
+                
+                iov.clear();
+                for (size_t i = 0; i < count; i++) {
+                    if (ready[i].output.empty()) continue;
+                    iov.push_back({const_cast<char*>(ready[i].output.data()), ready[i].output.size()});
+                }
+                write_all(fd, iov);
+                
+                // A checkpoint batch inside the group is durable once the group is
+                if (checkpoint) {
+                    uint64_t lines = cohort.lines_written;
+                    for (size_t i = 0; i < count; i++) lines -= ready[i].lines;
+                    for (size_t i = 0; i < count; i++) {
+                        size += ready[i].output.size();
+                        lines += ready[i].lines;
+                        if (checkpoint_due(ready[i])) commit_checkpoint(cohort, ready[i], size, lines);
+                    }
+                }
+                for (size_t i = 1; i < count; i++) {
+                    recycle_output(ready[i]);
+                }
+            }
+        } catch (...) {
+            if (!to_stdout) ::close(fd);
+            throw;
+        }
+        if (!to_stdout && ::close(fd) != 0) {
+            throw std::runtime_error("Write error on output file: " + cohort.output_file);
+        }
+    }
+#else
+    void write_regular_stream(Cohort& cohort) {
+        std::ofstream file;
+        if (!is_stdio(cohort.output_file)) {
+            file.open(cohort.output_file, std::ios::binary);
+            if (!file) {
+                throw std::runtime_error("Cannot create output file: " + cohort.output_file);
+            }
+        }
+        std::ostream out_file(is_stdio(cohort.output_file) ? stdout_data : file.rdbuf());
+        
+        out_file << cohort.plan.header;
+        
+        LineBatch batch;
+        while (next_output_batch(cohort, batch)) {
+            out_file.write(batch.output.data(), batch.output.size());
+        }
+        out_file.flush();
+    }
+#endif
+
+#ifdef VSF_HAVE_MMAP
+    // Filter one byte range of the mapped input into its own output part
+    void filter_range(const char* text, size_t len, const std::string& part_file, bool first,
+                      std::string& error) {
+        try {
+            std::unique_ptr<BgzfWriter> bgzf_out;
+            std::ofstream plain_out;
+            if (options.compress_output) {
+                bgzf_out.reset(new BgzfWriter(part_file, 0));
+            } else {
+                plain_out.open(part_file, std::ios::binary);
+                if (!plain_out) {
+                    throw std::runtime_error("Cannot create output file: " + part_file);
+                }
+            }
+            
+            auto write_out = [&](const std::string& data) {
+                if (bgzf_out) {
+                    bgzf_out->write(data.data(), data.size());
+                } else if (!plain_out.write(data.data(), data.size())) {
+                    throw std::runtime_error("Write error on " + part_file);
+                }
+            };
+            if (first) write_out(cohorts[0]->plan.header);
             
-            // Process the line
-            std::string processed_line;
-            if (line.empty() || line[0] == '#') {
-                if (line.find("#CHROM") == 0) {
-                    processed_line = process_header(line);
-                } else {
-                    processed_line = std::move(line);
+            RecordScratch scratch;
+            LineBatch batch;
+            std::vector<LineBatch*> results(1, &batch);
+            for (size_t pos = 0; pos < len;) {
+                size_t end = len;
+                if (len - pos > BATCH_BYTES) {
+                    const char* nl = static_cast<const char*>(
+                        memchr(text + pos + BATCH_BYTES, '\n', len - pos - BATCH_BYTES));
+                    if (nl) end = nl - text + 1;
                 }
-            } else {
-                processed_line = process_data_line(line);
+                batch.text = text + pos;
+                batch.text_size = end - pos;
+                size_t count = process_batch(batch, scratch, results);
+                lines_processed += count;
+                stats.records += count;
+                collect_dropped(scratch);
+                pos = end;
+                
+                write_out(batch.output);
+                batch.output.clear();
             }
             
-            // Add to output queue (wait if full)
-            std::unique_lock<std::mutex> output_lock(output_mutex);
-            output_cv.wait(output_lock, [this] { return output_queue.size() < MAX_QUEUE_SIZE; });
-            
-            output_queue.push(std::move(processed_line));
-            output_lock.unlock();
-            output_cv.notify_one();
-            
-            lines_processed++;
-            if (lines_processed % 10000 == 0) {
-                std::cout << "Processed " << lines_processed << " lines\r" << std::flush;
-            }
-        }
-    }
-    
-    // Writer thread - writes output as it becomes available
-    void writer_thread() {
-        try {
-            if (compress_output) {
-                write_gz_stream();
+            if (bgzf_out) {
+                bgzf_out->close(false); // Parts are concatenated; EOF block comes last
             } else {
-                write_regular_stream();
+                plain_out.close();
+                if (!plain_out) {
+                    throw std::runtime_error("Write error on " + part_file);
+                }
             }
         } catch (const std::exception& e) {
-            std::cerr << "Writer error: " << e.what() << std::endl;
+            error = e.what();
         }
     }
     
-    void write_gz_stream() {
-        gzFile out_file = gzopen(output_file.c_str(), "wb");
-        if (!out_file) {
-            throw std::runtime_error("Cannot create output file: " + output_file);
+    // Append a finished part to the output and remove it
+    static void append_part(int out_fd, const std::string& part_file) {
+        int in_fd = open(part_file.c_str(), O_RDONLY);
+        if (in_fd < 0) {
+            throw std::runtime_error("Cannot open " + part_file);
         }
         
-        while (true) {
-            std::unique_lock<std::mutex> lock(output_mutex);
-            output_cv.wait(lock, [this] { return !output_queue.empty() || finished_processing; });
-            
-            if (output_queue.empty() && finished_processing) {
-                break;
+        bool copied = false;
+#ifdef __linux__
+        // In-kernel copy; falls back to read/write where unsupported
+        struct stat st;
+        if (fstat(in_fd, &st) == 0) {
+            off_t left = st.st_size;
+            while (left > 0) {
+                ssize_t n = copy_file_range(in_fd, nullptr, out_fd, nullptr, left, 0);
+                if (n <= 0) break;
+                left -= n;
             }
-            
-            if (output_queue.empty()) {
-                continue;
+            copied = left == 0;
+            if (!copied) lseek(in_fd, st.st_size - left, SEEK_SET);
+        }
+#endif
+        if (!copied) {
+            std::vector<char> buffer(4 << 20);
+            ssize_t n;
+            while ((n = read(in_fd, buffer.data(), buffer.size())) > 0) {
+                for (ssize_t done = 0; done < n;) {
+                    ssize_t w = write(out_fd, buffer.data() + done, n - done);
+                    if (w < 0) {
+                        ::close(in_fd);
+                        throw std::runtime_error("Write error on output file");
+                    }
+                    done += w;
+                }
             }
-            
-            std::string line = std::move(output_queue.front());
-            output_queue.pop();
-            lock.unlock();
-            output_cv.notify_one();
-            
-            gzprintf(out_file, "%s\n", line.c_str());
         }
         
-        gzclose(out_file);
+        ::close(in_fd);
+        unlink(part_file.c_str());
     }
     
-    void write_regular_stream() {
-        std::ofstream out_file(output_file);
-        if (!out_file) {
-            throw std::runtime_error("Cannot create output file: " + output_file);
+    // Split the mapped input into one newline-aligned range per thread,
+    // filter the ranges independently and concatenate the parts in order.
+    // Split mode writes a single cohort
+    void filter_split() {
+        const std::string& output_file = cohorts[0]->output_file;
+        size_t len;
+        const char* text = mapped_input->remaining(len);
+        int parts = options.num_threads;
+        stats.input_bytes += len;
+        
+        std::vector<size_t> bounds(1, 0);
+        for (int i = 1; i < parts; i++) {
+            size_t cut = std::max(bounds.back(), len / parts * i);
+            const char* nl = cut < len ? static_cast<const char*>(memchr(text + cut, '\n', len - cut)) : nullptr;
+            bounds.push_back(nl ? nl - text + 1 : len);
         }
+        bounds.push_back(len);
         
-        while (true) {
-            std::unique_lock<std::mutex> lock(output_mutex);
-            output_cv.wait(lock, [this] { return !output_queue.empty() || finished_processing; });
-            
-            if (output_queue.empty() && finished_processing) {
-                break;
+        // The first range writes the output itself; the rest go to part files
+        std::vector<std::string> part_files(parts);
+        std::vector<std::string> errors(parts);
+        std::vector<std::thread> workers;
+        for (int i = 0; i < parts; i++) {
+            part_files[i] = i == 0 ? output_file : output_file + ".part" + std::to_string(i);
+            workers.emplace_back(&VCFSampleFilter::filter_range, this, text + bounds[i],
+                                 bounds[i + 1] - bounds[i], part_files[i], i == 0, std::ref(errors[i]));
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        
+        std::string error;
+        for (const std::string& e : errors) {
+            if (error.empty()) error = e;
+        }
+        
+        if (error.empty()) {
+            int out_fd = open(output_file.c_str(), O_WRONLY | O_APPEND);
+            if (out_fd < 0) {
+                error = "Cannot open output file: " + output_file;
+            } else {
+                try {
+                    for (int i = 1; i < parts; i++) {
+                        append_part(out_fd, part_files[i]);
+                    }
+                    if (options.compress_output &&
+                        write(out_fd, BGZF_EOF_BLOCK, sizeof(BGZF_EOF_BLOCK)) != sizeof(BGZF_EOF_BLOCK)) {
+                        throw std::runtime_error("Write error on output file");
+                    }
+                } catch (const std::exception& e) {
+                    error = e.what();
+                }
+                if (::close(out_fd) != 0 && error.empty()) {
+                    error = "Write error on output file";
+                }
             }
-            
-            if (output_queue.empty()) {
-                continue;
+        }
+        
+        for (int i = 1; i < parts; i++) {
+            unlink(part_files[i].c_str());
+        }
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+    }
+#endif
+
+    void report_dropped_sites() const {
+        for (const auto& cohort : cohorts) {
+            if (cohort->sites_dropped > 0) {
+                std::cout << "Dropped " << cohort->sites_dropped << " sites from " << cohort->output_file
+                          << " by site filters" << std::endl;
+            }
+            if (cohort->bed_skipped > 0) {
+                std::cout << "Skipped " << cohort->bed_skipped << " non-biallelic sites for bed output "
+                          << plink_prefix(cohort->output_file) << ".bed" << std::endl;
             }
-            
-            std::string line = std::move(output_queue.front());
-            output_queue.pop();
-            lock.unlock();
-            output_cv.notify_one();
-            
-            out_file << line << "\n";
         }
     }
-    
+
 public:
-    VCFSampleFilter(const std::string& input, const std::string& output, 
-                   const std::string& samples, bool compress = false, int threads = 1)
-        : input_file(input), output_file(output), sample_file(samples), 
-          compress_output(compress), num_threads(threads) {}
+    explicit VCFSampleFilter(const FilterOptions& options) : options(options) {
+        for (const auto& spec : options.cohorts) {
+            // A ^LIST names samples to exclude, as in bcftools -S ^file
+            bool exclude = options.exclude_samples || (spec.first.size() > 1 && spec.first[0] == '^');
+            cohorts.emplace_back(new Cohort);
+            cohorts.back()->exclude = exclude;
+            cohorts.back()->sample_file = spec.first[0] == '^' ? spec.first.substr(1) : spec.first;
+            cohorts.back()->output_file = spec.second;
+        }
+    }
     
     void filter() {
         std::cout << "Loading samples..." << std::endl;
-        load_samples();
+        for (auto& cohort : cohorts) {
+            load_samples(*cohort);
+        }
+        if (!options.regions.empty()) {
+            regions.load(options.regions);
+            std::cout << "Keeping sites in regions on " << regions.chromosomes().size()
+                      << " chromosomes" << std::endl;
+        }
+        
+        std::cout << "Reading header..." << std::endl;
+        read_header();
+        if (!options.checkpoint_file.empty()) open_checkpoint();
+
+#ifdef VSF_HAVE_MMAP
+        if (options.split_input && !mapped_input) {
+            std::cout << "--split needs uncompressed input; filtering as one stream" << std::endl;
+        } else if (options.split_input) {
+            std::cout << "Filtering " << options.num_threads << " byte ranges in parallel ("
+                      << delimiter_kernel.name << " delimiter scan)..." << std::endl;
+            auto start = std::chrono::steady_clock::now();
+            filter_split();
+            if (options.stats) {
+                report_stats(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            }
+            std::cout << "Filtering complete! Processed " << lines_processed << " lines" << std::endl;
+            report_dropped_sites();
+            return;
+        }
+#endif
+        
+        if (options.thread_budget) {
+            std::cout << "Starting streaming filter with " << options.thread_budget << " threads shared by all stages (";
+        } else {
+            std::cout << "Starting streaming filter with " << options.num_threads << " worker threads (";
+        }
+        std::cout << delimiter_kernel.name << " delimiter scan)..." << std::endl;
         
-        std::cout << "Starting streaming filter with " << num_threads << " worker threads..." << std::endl;
+        if (options.max_memory) {
+            // Smaller batches under a tight budget, so every worker still has
+            // one to process while the reader and writer each hold another
+            size_t share = options.max_memory / (2 * (options.num_threads + 2));
+            batch_bytes = std::max<size_t>(64 << 10, std::min<size_t>(BATCH_BYTES, share));
+            memory_budget.set_limit(options.max_memory);
+            input_buffers.set_max_capacity(2 * batch_bytes);
+            output_buffers.set_max_capacity(2 * batch_bytes);
+        }
+        
+        if (options.thread_budget) plan_threads();
+        auto start = std::chrono::steady_clock::now();
+        std::thread monitor(&VCFSampleFilter::monitor_thread, this);
         
         // Start reader thread
         std::thread reader(&VCFSampleFilter::reader_thread, this);
         
         // Start worker threads
         std::vector<std::thread> workers;
-        for (int i = 0; i < num_threads; i++) {
+        for (int i = 0; i < options.num_threads; i++) {
             workers.emplace_back(&VCFSampleFilter::worker_thread, this);
         }
         
-        // Start writer thread
-        std::thread writer(&VCFSampleFilter::writer_thread, this);
+        // Start one writer thread per cohort
+        std::vector<std::thread> writers;
+        for (auto& cohort : cohorts) {
+            writers.emplace_back(&VCFSampleFilter::writer_thread, this, std::ref(*cohort));
+        }
         
         // Wait for reader to finish
         reader.join();
@@ -384,32 +4233,373 @@ public:
             worker.join();
         }
         
-        // Signal writer to finish
-        finished_processing = true;
-        output_cv.notify_all();
+        // Signal writers to finish
+        for (auto& cohort : cohorts) {
+            cohort->output_batches.close();
+        }
+        
+        // Wait for writers to finish
+        for (auto& writer : writers) {
+            writer.join();
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(monitor_mutex);
+            monitor_done = true;
+        }
+        monitor_cv.notify_all();
+        monitor.join();
+        if (options.stats) {
+            report_stats(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
         
-        // Wait for writer to finish
-        writer.join();
+        if (failed) {
+            throw std::runtime_error("Filtering did not complete; output is incomplete");
+        }
+        if (checkpoint) checkpoint->remove();
         
         std::cout << "\nFiltering complete! Processed " << lines_processed << " lines" << std::endl;
+        report_dropped_sites();
+    }
+};
+
+const size_t VCFSampleFilter::MAX_QUEUE_SIZE;
+const size_t VCFSampleFilter::BATCH_BYTES;
+
+// --bench: writes a synthetic VCF of the requested shape (plain and BGZF),
+// times the reader, the record kernel and both writers in isolation on one
+// thread, then the whole pipeline end to end, and prints the rates as JSON.
+// Every second sample is selected, the worst case for copy runs
+class Benchmark {
+public:
+    struct Shape {
+        size_t samples = 0;
+        size_t sites = 0;
+        int fields = 1;  // FORMAT subfields, taken in order from GT:AD:DP:GQ:PL
+    };
+
+private:
+    struct Stage {
+        std::string name;
+        double seconds = 0;
+        size_t bytes = 0;    // Bytes read for input stages, written for output stages
+        size_t records = 0;
+        double peak_rss_mb = 0;  // Process high-water mark when the stage ended
+        
+        explicit Stage(const std::string& name) : name(name) {}
+    };
+    
+    FilterOptions options;
+    Shape shape;
+    std::string prefix;
+    std::vector<Stage> stages;
+    
+    static double now() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    
+    static double peak_rss_mb() {
+#ifdef VSF_HAVE_RUSAGE
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1048576.0; // Bytes
+#else
+        return usage.ru_maxrss / 1024.0;    // Kilobytes
+#endif
+#else
+        return 0;
+#endif
+    }
+    
+    static size_t file_size(const std::string& filename) {
+        std::ifstream file(filename, std::ios::binary | std::ios::ate);
+        return file ? static_cast<size_t>(file.tellg()) : 0;
+    }
+    
+    std::string format_column() const {
+        static const char* const NAMES[] = {"GT", "AD", "DP", "GQ", "PL"};
+        std::string format;
+        for (int f = 0; f < shape.fields; f++) {
+            if (f > 0) format += ':';
+            format += NAMES[f];
+        }
+        return format;
+    }
+    
+    // Biallelic sites with random genotypes at a per-site ALT frequency; the
+    // generator is seeded so every run sees the same input
+    void generate() {
+        std::ofstream plain(prefix + ".vcf", std::ios::binary);
+        std::ofstream samples(prefix + ".samples");
+        if (!plain || !samples) {
+            throw std::runtime_error("Cannot create benchmark files with prefix " + prefix);
+        }
+        BgzfWriter bgzf(prefix + ".vcf.gz", options.deflate_threads);
+        
+        std::string line = "##fileformat=VCFv4.2\n##contig=<ID=chr1>\n"
+                           "##INFO=<ID=AF,Number=A,Type=Float,Description=\"Allele frequency\">\n"
+                           "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n"
+                           "##FORMAT=<ID=AD,Number=R,Type=Integer,Description=\"Allelic depths\">\n"
+                           "##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"Read depth\">\n"
+                           "##FORMAT=<ID=GQ,Number=1,Type=Integer,Description=\"Genotype quality\">\n"
+                           "##FORMAT=<ID=PL,Number=G,Type=Integer,Description=\"Phred-scaled likelihoods\">\n"
+                           "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT";
+        for (size_t s = 0; s < shape.samples; s++) {
+            std::string name = "S" + std::to_string(s);
+            line += '\t';
+            line += name;
+            if (s % 2 == 0) samples << name << '\n';
+        }
+        line += '\n';
+        
+        static const char BASES[] = "ACGT";
+        std::string format = format_column();
+        std::mt19937 rng(42);
+        auto uniform = [&rng] { return rng() * (1.0 / 4294967296.0); };
+        for (size_t site = 0; site < shape.sites; site++) {
+            double af = 0.5 * uniform();
+            int ref = rng() % 4;
+            int alt = (ref + 1 + rng() % 3) % 4;
+            char fixed[160];
+            snprintf(fixed, sizeof(fixed), "chr1\t%zu\trs%zu\t%c\t%c\t50\tPASS\tAF=%.3f\t%s",
+                     1000 + site * 37, site, BASES[ref], BASES[alt], af, format.c_str());
+            line += fixed;
+            for (size_t s = 0; s < shape.samples; s++) {
+                int a = uniform() < af;
+                int b = uniform() < af;
+                int depth = 10 + rng() % 40;
+                int alt_depth = (a + b) * depth / 2;
+                int gq = rng() % 100;
+                char value[96];
+                int n = snprintf(value, sizeof(value), "\t%d/%d", a, b);
+                if (shape.fields > 1) n += snprintf(value + n, sizeof(value) - n, ":%d,%d", depth - alt_depth, alt_depth);
+                if (shape.fields > 2) n += snprintf(value + n, sizeof(value) - n, ":%d", depth);
+                if (shape.fields > 3) n += snprintf(value + n, sizeof(value) - n, ":%d", gq);
+                if (shape.fields > 4) {
+                    n += snprintf(value + n, sizeof(value) - n, ":%d,%d,%d", a + b == 0 ? 0 : 10 * gq,
+                                  a + b == 1 ? 0 : gq, a + b == 2 ? 0 : 30 + gq);
+                }
+                line.append(value, n);
+            }
+            line += '\n';
+            
+            if (line.size() >= (1 << 20) || site + 1 == shape.sites) {
+                plain.write(line.data(), line.size());
+                bgzf.write(line.data(), line.size());
+                line.clear();
+            }
+        }
+        bgzf.close();
+        plain.close();
+        if (!plain) {
+            throw std::runtime_error("Write error on " + prefix + ".vcf");
+        }
+    }
+    
+    FilterOptions run_options(const std::string& input, const std::string& output, bool compress) const {
+        FilterOptions run = options;
+        run.input_file = input;
+        run.cohorts.assign(1, {prefix + ".samples", output});
+        run.compress_output = compress;
+        return run;
+    }
+    
+    // One thread reads batches, filters them and writes the output plainly
+    // and as BGZF, with each step timed apart
+    void run_isolated() {
+        Stage read_plain("read_plain"), kernel("kernel"), write_plain("write_plain"), write_bgzf("write_bgzf");
+        {
+            VCFSampleFilter filter(run_options(prefix + ".vcf", prefix + ".out.vcf", false));
+            filter.load_samples(*filter.cohorts[0]);
+            filter.read_header();
+            
+            std::ofstream plain(prefix + ".out.vcf", std::ios::binary);
+            BgzfWriter bgzf(prefix + ".out.vcf.gz", options.deflate_threads);
+            RecordScratch scratch;
+            LineBatch batch;
+            std::vector<LineBatch*> results(1, &batch);
+            while (true) {
+                double start = now();
+                bool more = filter.input->read_lines(batch.input, VCFSampleFilter::BATCH_BYTES);
+                double read = now();
+                read_plain.seconds += read - start;
+                if (!more) break;
+                
+                size_t count = filter.process_batch(batch, scratch, results);
+                double filtered = now();
+                plain.write(batch.output.data(), batch.output.size());
+                double written = now();
+                bgzf.write(batch.output.data(), batch.output.size());
+                double compressed = now();
+                
+                kernel.seconds += filtered - read;
+                write_plain.seconds += written - filtered;
+                write_bgzf.seconds += compressed - written;
+                read_plain.bytes += batch.input.size();
+                kernel.bytes += batch.input.size();
+                write_plain.bytes += batch.output.size();
+                write_bgzf.bytes += batch.output.size();
+                read_plain.records += count;
+                kernel.records += count;
+                write_plain.records += count;
+                write_bgzf.records += count;
+                batch.input.clear();
+                batch.output.clear();
+            }
+            
+            double start = now();
+            bgzf.close();
+            write_bgzf.seconds += now() - start;
+            start = now();
+            plain.close();
+            write_plain.seconds += now() - start;
+        }
+        double rss = peak_rss_mb();
+        for (Stage* stage : {&read_plain, &kernel, &write_plain, &write_bgzf}) {
+            stage->peak_rss_mb = rss;
+        }
+        stages.push_back(read_plain);
+        
+        Stage read_bgzf("read_bgzf");
+        {
+            VCFSampleFilter filter(run_options(prefix + ".vcf.gz", prefix + ".out.vcf", false));
+            filter.load_samples(*filter.cohorts[0]);
+            filter.read_header();
+            std::string text;
+            double start = now();
+            while (filter.input->read_lines(text, VCFSampleFilter::BATCH_BYTES)) {
+                read_bgzf.bytes += text.size();
+                read_bgzf.records += std::count(text.begin(), text.end(), '\n');
+                text.clear();
+            }
+            read_bgzf.seconds = now() - start;
+        }
+        read_bgzf.peak_rss_mb = peak_rss_mb();
+        stages.push_back(read_bgzf);
+        stages.push_back(kernel);
+        stages.push_back(write_plain);
+        stages.push_back(write_bgzf);
+    }
+    
+    // The full pipeline with the configured threads; bytes are the input's
+    void run_pipeline(const std::string& name, const std::string& input, bool compress) {
+        Stage stage(name);
+        VCFSampleFilter filter(run_options(input, prefix + (compress ? ".out.vcf.gz" : ".out.vcf"), compress));
+        double start = now();
+        filter.filter();
+        stage.seconds = now() - start;
+        stage.bytes = file_size(input);
+        stage.records = filter.stats.records;
+        stage.peak_rss_mb = peak_rss_mb();
+        stages.push_back(stage);
+    }
+    
+    void report(std::ostream& out) const {
+        char text[256];
+        out << "{\n";
+        out << "  \"shape\": {\"samples\": " << shape.samples << ", \"sites\": " << shape.sites
+            << ", \"format\": \"" << format_column() << "\", \"selected_samples\": " << (shape.samples + 1) / 2 << "},\n";
+        out << "  \"threads\": {\"workers\": " << options.num_threads << ", \"inflate\": " << options.inflate_threads
+            << ", \"deflate\": " << options.deflate_threads << "},\n";
+        out << "  \"bgzf_codec\": \"" << BLOCK_CODEC << "\",\n";
+        out << "  \"input_bytes\": {\"vcf\": " << file_size(prefix + ".vcf") << ", \"vcf_gz\": "
+            << file_size(prefix + ".vcf.gz") << "},\n";
+        out << "  \"stages\": {\n";
+        for (size_t i = 0; i < stages.size(); i++) {
+            const Stage& stage = stages[i];
+            double seconds = std::max(stage.seconds, 1e-9);
+            snprintf(text, sizeof(text),
+                     "    \"%s\": {\"seconds\": %.4f, \"mb_per_s\": %.1f, \"records_per_s\": %.0f, \"peak_rss_mb\": %.1f}%s\n",
+                     stage.name.c_str(), stage.seconds, stage.bytes / 1048576.0 / seconds, stage.records / seconds,
+                     stage.peak_rss_mb, i + 1 < stages.size() ? "," : "");
+            out << text;
+        }
+        out << "  }\n}\n";
+    }
+
+public:
+    Benchmark(const FilterOptions& options, const Shape& shape, const std::string& prefix)
+        : options(options), shape(shape), prefix(prefix) {}
+    
+    // Progress messages from the stages are silenced; only the JSON reaches stdout
+    void run() {
+        std::streambuf* console = std::cout.rdbuf(nullptr);
+        try {
+            generate();
+            run_isolated();
+            run_pipeline("end_to_end_plain", prefix + ".vcf", false);
+            run_pipeline("end_to_end_bgzf", prefix + ".vcf.gz", true);
+        } catch (...) {
+            std::cout.rdbuf(console);
+            throw;
+        }
+        std::cout.rdbuf(console);
+        report(std::cout);
+        
+        for (const char* suffix : {".vcf", ".vcf.gz", ".samples", ".out.vcf", ".out.vcf.gz"}) {
+            std::remove((prefix + suffix).c_str());
+        }
     }
 };
 
+// Parse a byte count with an optional K, M or G suffix (powers of 1024)
+bool parse_size(const std::string& text, size_t& bytes) {
+    char* end = nullptr;
+    unsigned long long value = strtoull(text.c_str(), &end, 10);
+    if (end == text.c_str()) return false;
+    
+    int shift = 0;
+    switch (toupper(static_cast<unsigned char>(*end))) {
+        case '\0': break;
+        case 'K': shift = 10; end++; break;
+        case 'M': shift = 20; end++; break;
+        case 'G': shift = 30; end++; break;
+        default: return false;
+    }
+    if (*end == 'B' || *end == 'b') end++;
+    if (*end != '\0' || value > (SIZE_MAX >> shift)) return false;
+    
+    bytes = static_cast<size_t>(value) << shift;
+    return true;
+}
+
 void print_usage(const char* program_name) {
     std::cout << "Usage: " << program_name << " [options]\n"
               << "Options:\n"
-              << "  -i, --input FILE      Input VCF file (.vcf or .vcf.gz)\n"
-              << "  -o, --output FILE     Output VCF file\n"
+              << "  -i, --input FILE      Input VCF or BCF file (.vcf, .vcf.gz or .bcf; - for stdin)\n"
+              << "  -o, --output FILE     Output VCF file (- for stdout)\n"
               << "  -s, --samples FILE    File containing sample names (one per line)\n"
-              << "  -z, --compress        Compress output with gzip\n"
+              << "  -s LIST:OUTPUT        Extra cohort: sample list and its own output (repeatable)\n"
+              << "  --cohorts FILE        Cohorts from a file of 'sample_list output' lines\n"
+              << "  --exclude             Sample lists name samples to drop (or prefix one list with ^)\n"
+              << "  --sample-order        Write samples in sample-file order instead of VCF order\n"
+              << "  -z, --compress        Compress output with BGZF (bgzip-compatible gzip)\n"
+              << "  --output-format FMT   vcf (default) or bed: PLINK .bed/.bim/.fam named after -o\n"
+              << "  --index FORMAT        With -z, also write a tbi or csi index\n"
+              << "  --format-fields LIST  Keep only these FORMAT subfields, e.g. GT or GT,DP\n"
+              << "  --fill-tags           Recompute INFO AC, AN and AF for the selected samples\n"
+              << "  --regions LIST|FILE   Keep sites whose CHROM/POS fall in chr, chr:pos or chr:begin-end\n"
+              << "  --min-ac NUM          Keep sites with at least NUM ALT alleles in the selected samples\n"
+              << "  --exclude-monomorphic Drop sites where the selected samples show at most one allele\n"
+              << "  --mmap                Memory-map uncompressed input instead of reading it\n"
+              << "  --split               Filter one byte range of uncompressed input per thread\n"
               << "  -t, --threads NUM     Number of threads (default: 1)\n"
+              << "  -t auto[:N]           Share N threads (default: all cores) between stages, rebalanced as it runs\n"
+              << "  --max-memory SIZE     Cap bytes of queued batches, e.g. 512M or 4G\n"
+              << "  --checkpoint FILE     Save progress to FILE as it runs; rerun to resume from it\n"
+              << "  --inflate-threads NUM Threads inflating BGZF input (default: same as -t)\n"
+              << "  --deflate-threads NUM Threads compressing -z output (default: same as -t)\n"
+              << "  --stats               Print stage rates to stderr each second and a JSON summary\n"
+              << "  --bench SHAPE         Benchmark a synthetic SAMPLESxSITES[xFIELDS] VCF, report JSON\n"
               << "  -h, --help           Show this help message\n";
 }
 
 int main(int argc, char* argv[]) {
-    std::string input_file, output_file, sample_file;
-    bool compress_output = false;
-    int num_threads = 1;
+    FilterOptions options;
+    std::string output_file;
+    std::string sample_file;
+    Benchmark::Shape bench_shape;
     
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
@@ -420,7 +4610,7 @@ int main(int argc, char* argv[]) {
             return 0;
         } else if (arg == "-i" || arg == "--input") {
             if (i + 1 < argc) {
-                input_file = argv[++i];
+                options.input_file = argv[++i];
             } else {
                 std::cerr << "Error: " << arg << " requires a filename" << std::endl;
                 return 1;
@@ -434,17 +4624,97 @@ int main(int argc, char* argv[]) {
             }
         } else if (arg == "-s" || arg == "--samples") {
             if (i + 1 < argc) {
-                sample_file = argv[++i];
+                // LIST:OUTPUT names a cohort of its own unless LIST:OUTPUT is itself a file
+                std::string value = argv[++i];
+                size_t colon = value.rfind(':');
+                if (colon != std::string::npos && colon > 0 && colon + 1 < value.size() &&
+                    !std::ifstream(value)) {
+                    options.cohorts.push_back({value.substr(0, colon), value.substr(colon + 1)});
+                } else if (sample_file.empty()) {
+                    sample_file = value;
+                } else {
+                    std::cerr << "Error: Only one -s without :OUTPUT may be given" << std::endl;
+                    return 1;
+                }
+            } else {
+                std::cerr << "Error: " << arg << " requires a filename" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--exclude") {
+            options.exclude_samples = true;
+        } else if (arg == "--sample-order") {
+            options.sample_order = true;
+        } else if (arg == "--cohorts") {
+            if (i + 1 < argc) {
+                std::ifstream manifest(argv[++i]);
+                if (!manifest) {
+                    std::cerr << "Error: Cannot open cohort file " << argv[i] << std::endl;
+                    return 1;
+                }
+                std::string line;
+                while (std::getline(manifest, line)) {
+                    std::istringstream fields(line);
+                    std::string samples, output;
+                    if (!(fields >> samples) || samples[0] == '#') continue;
+                    if (!(fields >> output)) {
+                        std::cerr << "Error: Cohort line needs a sample list and an output: " << line << std::endl;
+                        return 1;
+                    }
+                    options.cohorts.push_back({samples, output});
+                }
             } else {
                 std::cerr << "Error: " << arg << " requires a filename" << std::endl;
                 return 1;
             }
         } else if (arg == "-z" || arg == "--compress") {
-            compress_output = true;
+            options.compress_output = true;
+        } else if (arg == "--output-format") {
+            if (i + 1 < argc) {
+                options.output_format = argv[++i];
+                if (options.output_format != "vcf" && options.output_format != "bed") {
+                    std::cerr << "Error: Output format must be vcf or bed" << std::endl;
+                    return 1;
+                }
+            } else {
+                std::cerr << "Error: " << arg << " requires a format" << std::endl;
+                return 1;
+            }
         } else if (arg == "-t" || arg == "--threads") {
+            if (i + 1 < argc && std::string(argv[i + 1]).compare(0, 4, "auto") == 0) {
+                // auto or auto:N, N threads shared by all stages (default: all cores)
+                std::string value = argv[++i];
+                int budget = value.size() > 5 && value[4] == ':' ? std::atoi(value.c_str() + 5)
+                           : value.size() == 4 ? static_cast<int>(std::thread::hardware_concurrency()) : -1;
+                if (budget < 0 || (value.size() > 4 && budget == 0)) {
+                    std::cerr << "Error: Use -t auto or -t auto:N" << std::endl;
+                    return 1;
+                }
+                options.thread_budget = std::max(2, budget);
+            } else if (i + 1 < argc) {
+                options.num_threads = std::stoi(argv[++i]);
+                if (options.num_threads < 1) {
+                    std::cerr << "Error: Number of threads must be positive" << std::endl;
+                    return 1;
+                }
+            } else {
+                std::cerr << "Error: " << arg << " requires a number" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--inflate-threads") {
+            if (i + 1 < argc) {
+                options.inflate_threads = std::stoi(argv[++i]);
+                if (options.inflate_threads < 1) {
+                    std::cerr << "Error: Number of threads must be positive" << std::endl;
+                    return 1;
+                }
+            } else {
+                std::cerr << "Error: " << arg << " requires a number" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--deflate-threads") {
             if (i + 1 < argc) {
-                num_threads = std::stoi(argv[++i]);
-                if (num_threads < 1) {
+                options.deflate_threads = std::stoi(argv[++i]);
+                if (options.deflate_threads < 1) {
                     std::cerr << "Error: Number of threads must be positive" << std::endl;
                     return 1;
                 }
@@ -452,6 +4722,96 @@ int main(int argc, char* argv[]) {
                 std::cerr << "Error: " << arg << " requires a number" << std::endl;
                 return 1;
             }
+        } else if (arg == "--max-memory") {
+            if (i + 1 < argc) {
+                if (!parse_size(argv[++i], options.max_memory) || options.max_memory == 0) {
+                    std::cerr << "Error: Invalid memory size " << argv[i] << std::endl;
+                    return 1;
+                }
+            } else {
+                std::cerr << "Error: " << arg << " requires a size" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--format-fields") {
+            if (i + 1 < argc) {
+                std::istringstream list(argv[++i]);
+                std::string key;
+                while (std::getline(list, key, ',')) {
+                    if (key.empty()) continue;
+                    options.format_fields.push_back(key);
+                }
+                if (options.format_fields.empty()) {
+                    std::cerr << "Error: " << arg << " requires at least one field" << std::endl;
+                    return 1;
+                }
+            } else {
+                std::cerr << "Error: " << arg << " requires a list of fields" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--fill-tags") {
+            options.fill_tags = true;
+        } else if (arg == "--regions") {
+            if (i + 1 < argc) {
+                options.regions = argv[++i];
+            } else {
+                std::cerr << "Error: " << arg << " requires a region list or file" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--checkpoint") {
+            if (i + 1 < argc) {
+                options.checkpoint_file = argv[++i];
+            } else {
+                std::cerr << "Error: " << arg << " requires a file" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--min-ac") {
+            if (i + 1 < argc) {
+                options.min_ac = std::stoi(argv[++i]);
+                if (options.min_ac < 0) {
+                    std::cerr << "Error: --min-ac must not be negative" << std::endl;
+                    return 1;
+                }
+            } else {
+                std::cerr << "Error: " << arg << " requires a number" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--exclude-monomorphic") {
+            options.exclude_monomorphic = true;
+        } else if (arg == "--stats") {
+            options.stats = true;
+        } else if (arg == "--mmap") {
+            options.use_mmap = true;
+        } else if (arg == "--split") {
+#ifdef VSF_HAVE_MMAP
+            options.split_input = true;
+#else
+            std::cerr << "Error: --split is not supported on this platform" << std::endl;
+            return 1;
+#endif
+        } else if (arg == "--bench") {
+            if (i + 1 < argc) {
+                int fields = 1;
+                int n = sscanf(argv[++i], "%zux%zux%d", &bench_shape.samples, &bench_shape.sites, &fields);
+                if (n < 2 || bench_shape.samples == 0 || bench_shape.sites == 0 || fields < 1 || fields > 5) {
+                    std::cerr << "Error: --bench needs SAMPLESxSITES[xFIELDS] with 1 to 5 fields" << std::endl;
+                    return 1;
+                }
+                bench_shape.fields = fields;
+            } else {
+                std::cerr << "Error: " << arg << " requires a shape" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--index") {
+            if (i + 1 < argc) {
+                options.index_format = argv[++i];
+                if (options.index_format != "tbi" && options.index_format != "csi") {
+                    std::cerr << "Error: Index format must be tbi or csi" << std::endl;
+                    return 1;
+                }
+            } else {
+                std::cerr << "Error: " << arg << " requires a format" << std::endl;
+                return 1;
+            }
         } else {
             std::cerr << "Error: Unknown option " << arg << std::endl;
             print_usage(argv[0]);
@@ -459,15 +4819,101 @@ int main(int argc, char* argv[]) {
         }
     }
     
+    if (options.thread_budget) {
+        // Every stage may grow to the whole budget; permits cap them
+        size_t cohorts = std::max<size_t>(1, options.cohorts.size() + !sample_file.empty());
+        options.num_threads = options.thread_budget;
+        options.inflate_threads = options.thread_budget;
+        options.deflate_threads = options.thread_budget * static_cast<int>(cohorts);
+    }
+    if (options.inflate_threads == 0) {
+        options.inflate_threads = options.num_threads;
+    }
+    if (options.deflate_threads == 0) {
+        options.deflate_threads = options.num_threads;
+    }
+    
+    // The benchmark makes its own input; -o, if given, is the prefix of its files
+    if (bench_shape.samples > 0) {
+        try {
+            Benchmark(options, bench_shape, output_file.empty() ? "vsf_bench" : output_file).run();
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    
     // Check required arguments
-    if (input_file.empty() || output_file.empty() || sample_file.empty()) {
+    if (!sample_file.empty() || !output_file.empty()) {
+        if (sample_file.empty() || output_file.empty()) {
+            std::cerr << "Error: -s and -o must be given together" << std::endl;
+            return 1;
+        }
+        options.cohorts.insert(options.cohorts.begin(), {sample_file, output_file});
+    }
+    if (options.input_file.empty() || options.cohorts.empty()) {
         std::cerr << "Error: Input file, output file, and sample file are required" << std::endl;
         print_usage(argv[0]);
         return 1;
     }
     
+    std::unordered_set<std::string> outputs;
+    for (const auto& cohort : options.cohorts) {
+        if (!outputs.insert(cohort.second).second) {
+            std::cerr << "Error: Output file " << cohort.second << " is given twice" << std::endl;
+            return 1;
+        }
+    }
+    if (options.split_input && options.cohorts.size() > 1) {
+        std::cerr << "Error: --split writes a single cohort" << std::endl;
+        return 1;
+    }
+    
+    if (options.output_format == "bed" && (options.compress_output || options.split_input)) {
+        std::cerr << "Error: --output-format bed cannot be combined with -z or --split" << std::endl;
+        return 1;
+    }
+    if (!options.index_format.empty() && !options.compress_output) {
+        std::cerr << "Error: --index requires -z" << std::endl;
+        return 1;
+    }
+    if (options.split_input && !options.index_format.empty()) {
+        std::cerr << "Error: --index cannot be combined with --split" << std::endl;
+        return 1;
+    }
+    bool to_stdout = outputs.count("-") > 0;
+    if (to_stdout && (options.output_format == "bed" || options.split_input || !options.index_format.empty())) {
+        std::cerr << "Error: output to stdout (-) cannot be combined with --output-format bed, --split or --index"
+                  << std::endl;
+        return 1;
+    }
+    if (is_stdio(options.input_file) && options.split_input) {
+        std::cerr << "Error: --split needs an input file, not stdin" << std::endl;
+        return 1;
+    }
+    if (!options.checkpoint_file.empty()) {
+#ifndef VSF_HAVE_MMAP
+        std::cerr << "Error: --checkpoint is not supported on this platform" << std::endl;
+        return 1;
+#endif
+        if (is_stdio(options.input_file) || to_stdout || options.split_input || options.output_format == "bed" ||
+            !options.index_format.empty()) {
+            std::cerr << "Error: --checkpoint needs file input and output and cannot be combined with "
+                         "--split, --index or --output-format bed" << std::endl;
+            return 1;
+        }
+    }
+    if (to_stdout) {
+        // Progress messages go to stderr so they stay out of the data
+        stdout_data = std::cout.rdbuf(std::cerr.rdbuf());
+#ifdef VSF_HAVE_MMAP
+        widen_pipe(STDOUT_FILENO);
+#endif
+    }
+    
     try {
-        VCFSampleFilter filter(input_file, output_file, sample_file, compress_output, num_threads);
+        VCFSampleFilter filter(options);
         filter.filter();
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;